@@ -0,0 +1,75 @@
+#include "ycc.h"
+
+// Objects are carved out of large zero-filled chunks by bumping a
+// pointer, so objects allocated one after another end up adjacent in
+// memory. Nothing is freed individually; a whole arena is released at once.
+#define ARENA_CHUNK_SIZE (1 << 20)
+#define ARENA_ALIGN 16
+
+struct ArenaChunk {
+  ArenaChunk *next;
+  char data[];
+};
+
+Arena tok_arena;
+Arena node_arena;
+Arena type_arena;
+Arena sym_arena;
+Arena ir_arena;
+
+// Bytes handed out by arenas that have since been released
+static size_t released;
+
+static void new_chunk(Arena *arena, size_t size) {
+  size_t cap = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+  ArenaChunk *chunk = calloc(1, sizeof(ArenaChunk) + cap);
+  if (!chunk) {
+    error("out of memory");
+  }
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena->cur = chunk->data;
+  arena->end = chunk->data + cap;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  if (arena->end - arena->cur < size) {
+    new_chunk(arena, size);
+  }
+  void *p = arena->cur;
+  arena->cur += size;
+  arena->used += size;
+  return p;
+}
+
+char *arena_strndup(Arena *arena, char *p, size_t len) {
+  char *s = arena_alloc(arena, len + 1);
+  memcpy(s, p, len);
+  return s;
+}
+
+void arena_release(Arena *arena) {
+  ArenaChunk *chunk = arena->chunks;
+  while (chunk) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  released += arena->used;
+  *arena = (Arena){};
+}
+
+void release_arenas(void) {
+  arena_release(&tok_arena);
+  arena_release(&node_arena);
+  arena_release(&type_arena);
+  arena_release(&sym_arena);
+  arena_release(&ir_arena);
+}
+
+// Returns the number of bytes allocated from all arenas so far.
+size_t arena_total(void) {
+  return released + tok_arena.used + node_arena.used + type_arena.used +
+         sym_arena.used + ir_arena.used;
+}
@@ -0,0 +1,113 @@
+#!/bin/bash
+# Compile-throughput benchmark. Each generator writes a program whose
+# size grows with its argument; ycc compiles it at 1x, 2x and 4x the
+# base size, and the best of three runs is reported. If compile time
+# grows faster than n^SCALE_LIMIT between the smallest and largest
+# input, the generator is flagged as scaling super-linearly.
+ycc=${YCC:-./ycc}
+scale=${BENCH_SCALE:-1}
+limit=${SCALE_LIMIT:-1.3}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# int g0; int g1; ...
+globals() {
+  awk -v n=$1 'BEGIN {
+    for (i = 0; i < n; i++) printf "int g%d;\n", i
+    print "int main() { g0 = 1; return g0; }"
+  }'
+}
+
+# One function with many statements and locals
+long_function() {
+  awk -v n=$1 'BEGIN {
+    print "int main() {"
+    print "  int s = 0;"
+    for (i = 0; i < n; i++) {
+      printf "  int v%d = %d;\n", i, i
+      printf "  if (v%d > s) s = s + v%d * 3; else s = s - 1;\n", i, i
+    }
+    print "  return s;"
+    print "}"
+  }'
+}
+
+# x+(0*x+(1*x+...)) nested to the given depth
+deep_expression() {
+  awk -v n=$1 'BEGIN {
+    printf "int main() { int x = 1; return "
+    for (i = 0; i < n; i++) printf "x+(%d*", i
+    printf "x"
+    for (i = 0; i < n; i++) printf ")"
+    print "; }"
+  }'
+}
+
+# Many distinct string literals
+strings() {
+  awk -v n=$1 'BEGIN {
+    print "int main() {"
+    print "  char *s;"
+    for (i = 0; i < n; i++) printf "  s = \"string literal number %d\";\n", i
+    print "  return s[0];"
+    print "}"
+  }'
+}
+
+# Many small functions calling each other
+small_functions() {
+  awk -v n=$1 'BEGIN {
+    print "int f0(int x) { return x; }"
+    for (i = 1; i < n; i++)
+      printf "int f%d(int x) { return f%d(x) + %d; }\n", i, i - 1, i % 7
+    printf "int main() { return f%d(0); }\n", n - 1
+  }'
+}
+
+now() { date +%s%N; }
+
+# Prints the best wall time of three compilations in seconds.
+measure() {
+  best=
+  for run in 1 2 3; do
+    start=$(now)
+    "$ycc" --stats="$dir/stats.json" -o /dev/null "$1" || return 1
+    end=$(now)
+    t=$((end - start))
+    if [ -z "$best" ] || [ $t -lt $best ]; then
+      best=$t
+    fi
+  done
+  awk -v t=$best 'BEGIN { printf "%.6f", t / 1e9 }'
+}
+
+bench() {
+  name=$1
+  base=$(($2 * scale))
+  first=
+  for mul in 1 2 4; do
+    n=$((base * mul))
+    src="$dir/$name.c"
+    $name $n >"$src"
+    secs=$(measure "$src") || exit 1
+    lines=$(wc -l <"$src")
+    tokens=$(sed -n 's/.*"tokens": \([0-9]*\).*/\1/p' "$dir/stats.json")
+    awk -v name=$name -v n=$n -v s=$secs -v l=$lines -v t=$tokens 'BEGIN {
+      printf "%-16s %8d %9.1f %12.0f %12.0f\n", name, n, s * 1e3, l / s, t / s
+    }'
+    [ -z "$first" ] && first=$secs
+    last=$secs
+  done
+  awk -v name=$name -v a=$first -v b=$last -v limit=$limit 'BEGIN {
+    k = log(b / a) / log(4)
+    if (k > limit)
+      printf "%-16s super-linear: time grows as n^%.2f\n", name, k
+  }'
+}
+
+printf "%-16s %8s %9s %12s %12s\n" input n "time(ms)" lines/s tokens/s
+bench globals 20000
+bench long_function 5000
+bench deep_expression 2000
+bench strings 10000
+bench small_functions 5000
@@ -0,0 +1,318 @@
+#include "ycc.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk cache of generated functions, enabled by --cache=<dir>. Once
+// inlining is done, nothing but its own AST goes into the code of a
+// function, so each function is hashed together with the types,
+// variables and callees its AST refers to. A function whose hash is in
+// the cache skips SSA optimization and codegen; the recording of its
+// output made by an earlier compilation (see emit.c) is replayed
+// instead. The hash also covers the compiler binary and the flags that
+// change the code.
+//
+// Each entry is a file named after its hash. A hit touches the file, and
+// once the directory exceeds its size limit, the least recently used
+// entries are removed.
+
+#define CACHE_MAGIC "ycc-cache-1\n"
+#define CACHE_MAGIC_LEN (int)(sizeof(CACHE_MAGIC) - 1)
+
+typedef struct {
+  char magic[CACHE_MAGIC_LEN];
+  unsigned long hash;
+} Header;
+
+typedef struct {
+  char *name;
+  long size;
+  struct timespec mtime;
+} Entry;
+
+static char *cache_dir;
+static long cache_limit;
+static unsigned long salt;
+static long stored; // Number of entries stored by this compilation
+
+// Mixes in a word at a time: most of what is hashed is small integers.
+static void hash_long(unsigned long *h, long val) {
+  *h = (*h ^ val) * 0x9e3779b97f4a7c15;
+  *h ^= *h >> 29;
+}
+
+static void hash_str(unsigned long *h, char *s) {
+  for (; *s; s++) {
+    hash_long(h, *s);
+  }
+  hash_long(h, 0);
+}
+
+static void hash_type(unsigned long *h, Type *ty) {
+  for (; ty; ty = ty->base) {
+    hash_long(h, ty->kind);
+    hash_long(h, ty->size);
+    hash_long(h, ty->align);
+    hash_long(h, ty->array_len);
+  }
+  hash_long(h, -1);
+}
+
+// Locals are identified by their position in the function's list, which
+// hash_function() stores in their offset; codegen assigns the real
+// offsets later. Globals and functions are identified by name.
+static void hash_var(unsigned long *h, Obj *var) {
+  if (!var) {
+    hash_long(h, 0);
+  } else if (var->is_local) {
+    hash_long(h, 'L');
+    hash_long(h, var->offset);
+  } else {
+    hash_long(h, 'G');
+    hash_str(h, var->name);
+  }
+}
+
+static void hash_node(unsigned long *h, Node *node) {
+  for (; node; node = node->next) {
+    hash_long(h, node->kind);
+    hash_long(h, node->val);
+    hash_long(h, node->is_exact);
+    hash_type(h, node->ty);
+    hash_var(h, node->var);
+    hash_str(h, node->funcname ? node->funcname : "");
+    for (Obj *var = node->locals; var; var = var->scope_next) {
+      hash_var(h, var);
+    }
+    hash_long(h, -2);
+    hash_node(h, node->lhs);
+    hash_node(h, node->rhs);
+    hash_node(h, node->cond);
+    hash_node(h, node->then);
+    hash_node(h, node->els);
+    hash_node(h, node->init);
+    hash_node(h, node->inc);
+    hash_node(h, node->body);
+    hash_node(h, node->args);
+  }
+  hash_long(h, -3);
+}
+
+static unsigned long hash_function(Obj *fn) {
+  unsigned long h = salt;
+  hash_str(&h, fn->name);
+  int i = 0;
+  for (Obj *var = fn->locals; var; var = var->next) {
+    var->offset = ++i;
+    hash_type(&h, var->ty);
+  }
+  for (Obj *var = fn->params; var; var = var->next) {
+    hash_var(&h, var);
+  }
+  hash_node(&h, fn->body);
+  return h;
+}
+
+static void entry_path(char *buf, unsigned long hash) {
+  snprintf(buf, PATH_MAX, "%s/%016lx", cache_dir, hash);
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Loads the recording of a function from its entry, if there is one.
+static void load(Obj *fn) {
+  char path[PATH_MAX];
+  entry_path(path, fn->hash);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  Header hdr;
+  if (fstat(fd, &st) || st.st_size < sizeof(hdr) ||
+      !read_all(fd, &hdr, sizeof(hdr)) ||
+      memcmp(hdr.magic, CACHE_MAGIC, CACHE_MAGIC_LEN) ||
+      hdr.hash != fn->hash) {
+    close(fd);
+    return;
+  }
+  int len = st.st_size - sizeof(hdr);
+  char *buf = malloc(len ? len : 1);
+  if (!read_all(fd, buf, len)) {
+    free(buf);
+    close(fd);
+    return;
+  }
+  // Mark the entry as recently used.
+  futimens(fd, NULL);
+  close(fd);
+  fn->cached = buf;
+  fn->cached_len = len;
+}
+
+// Opens the cache in dir, creating the directory if needed. The cache
+// holds at most limit bytes.
+void cache_open(char *dir, long limit) {
+  if (mkdir(dir, 0777) && errno != EEXIST) {
+    error("cannot create cache directory: %s: %s", dir, strerror(errno));
+  }
+  cache_dir = dir;
+  cache_limit = limit;
+
+  salt = 0;
+  struct stat st;
+  if (!stat("/proc/self/exe", &st)) {
+    hash_long(&salt, st.st_size);
+    hash_long(&salt, st.st_mtim.tv_sec);
+    hash_long(&salt, st.st_mtim.tv_nsec);
+  }
+  hash_long(&salt, opt_fpeephole);
+  hash_long(&salt, opt_flicm);
+  hash_long(&salt, opt_fomit_frame_pointer);
+  hash_long(&salt, opt_foptimize_sibling_calls);
+}
+
+// Hashes the functions of the program and loads those that are cached.
+void cache_lookup(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function) {
+      continue;
+    }
+    fn->hash = hash_function(fn);
+    load(fn);
+    if (fn->cached) {
+      stats.cache_hits++;
+    } else {
+      stats.cache_misses++;
+    }
+  }
+}
+
+// Stores the recording of a function's output. Entries are written to a
+// temporary file and renamed, so that a concurrent compilation never
+// sees a partial one. Called from the codegen threads.
+void cache_store(Obj *fn, char *buf, int len) {
+  static long seq;
+  char path[PATH_MAX];
+  char tmp[PATH_MAX + 32];
+  entry_path(path, fn->hash);
+  snprintf(tmp, sizeof(tmp), "%s.%d.%ld", path, getpid(),
+           __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd >= 0) {
+    Header hdr = {.hash = fn->hash};
+    memcpy(hdr.magic, CACHE_MAGIC, CACHE_MAGIC_LEN);
+    bool ok = write_all(fd, &hdr, sizeof(hdr)) && write_all(fd, buf, len);
+    close(fd);
+    if (ok && !rename(tmp, path)) {
+      __atomic_fetch_add(&stored, 1, __ATOMIC_RELAXED);
+    } else {
+      unlink(tmp);
+    }
+  }
+}
+
+static int by_mtime(const void *a, const void *b) {
+  const Entry *x = a;
+  const Entry *y = b;
+  if (x->mtime.tv_sec != y->mtime.tv_sec) {
+    return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+  }
+  if (x->mtime.tv_nsec != y->mtime.tv_nsec) {
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+  }
+  return 0;
+}
+
+static bool is_entry_name(char *name) {
+  int len = strlen(name);
+  return len == 16 && strspn(name, "0123456789abcdef") == len;
+}
+
+// Removes the least recently used entries while the cache is over its
+// limit. The directory is only scanned if this compilation added to it.
+static void evict(void) {
+  if (!stored) {
+    return;
+  }
+  DIR *dir = opendir(cache_dir);
+  if (!dir) {
+    return;
+  }
+  Entry *entries = NULL;
+  int len = 0;
+  int cap = 0;
+  long total = 0;
+  for (struct dirent *de; (de = readdir(dir));) {
+    if (!is_entry_name(de->d_name)) {
+      continue;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+    struct stat st;
+    if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (len == cap) {
+      cap = cap ? cap * 2 : 64;
+      entries = realloc(entries, cap * sizeof(Entry));
+      if (!entries) {
+        error("out of memory");
+      }
+    }
+    entries[len++] = (Entry){strdup(path), st.st_size, st.st_mtim};
+    total += st.st_size;
+  }
+  closedir(dir);
+
+  qsort(entries, len, sizeof(Entry), by_mtime);
+  for (int i = 0; i < len; i++) {
+    if (total > cache_limit && !unlink(entries[i].name)) {
+      total -= entries[i].size;
+    }
+    free(entries[i].name);
+  }
+  free(entries);
+}
+
+// Evicts entries over the limit and frees the loaded recordings.
+void cache_close(Obj *prog) {
+  evict();
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    free(fn->cached);
+    fn->cached = NULL;
+  }
+}
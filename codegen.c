@@ -1,262 +1,1009 @@
 #include "ycc.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 
-static int depth = 0;
-static char *argreg64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
-static char *argreg8[] = {"%dil", "%sil", "%dl", "%cl", "%r8b", "r9b"};
-static Obj *current_fn;
-static void gen_expr(Node *node);
-static void gen_stmt(Node *node);
-static int count() {
-  static int i = 1;
-  return i++;
+// Expression temporaries live on a stack of caller-saved registers: the
+// i-th live temporary is kept in tmpreg[i], and only once all of them are
+// taken do further temporaries spill to the machine stack. The first six
+// entries match argreg so that call arguments are evaluated in place.
+static Reg tmpreg[] = {RDI, RSI, RDX, RCX, R8, R9, R10, R11};
+#define NTMP (int)(sizeof(tmpreg) / sizeof(*tmpreg))
+
+static Reg argreg[] = {RDI, RSI, RDX, RCX, R8, R9};
+#define NARGREG (int)(sizeof(argreg) / sizeof(*argreg))
+
+// Functions are generated concurrently, so the state of the function
+// being generated is per thread. Labels are numbered by basic block and
+// qualified by the function name when printed.
+static _Thread_local int depth; // Number of live temporaries
+static _Thread_local int spill; // 8-byte words pushed onto the machine stack
+static _Thread_local Obj *current_fn;
+static _Thread_local bool sibling_calls; // Tail calls may reuse the frame
+static _Thread_local bool omit_fp; // Locals are addressed relative to %rsp
+
+static Operand none() { return (Operand){OP_NONE}; }
+
+static Operand reg(Reg r) { return (Operand){OP_REG, .size = 8, .reg = r}; }
+
+static Operand reg8(Reg r) { return (Operand){OP_REG, .size = 1, .reg = r}; }
+
+static Operand imm(long val) { return (Operand){OP_IMM, .val = val}; }
+
+static Operand mem(Reg base, int disp) {
+  return (Operand){OP_MEM, .reg = base, .val = disp};
+}
+
+static Operand mem_index(Reg base, Reg index, int scale) {
+  return (Operand){OP_MEM, .reg = base, .index = index, .scale = scale};
+}
+
+// Returns the bytes reserved below the return address by a function
+// without a frame pointer. The locals are kept above %rsp, and the slot
+// where %rbp would be saved keeps %rsp 16-byte aligned.
+static int omitted_frame_size(Obj *fn) {
+  return fn->stack_size ? fn->stack_size + 8 : 0;
+}
+
+// Returns the memory operand of a local at the given offset from the
+// frame pointer. Without one, the offset is taken from where %rbp would
+// point, i.e. just below the return address, so the frame layout is the
+// same either way; %rsp is below that by the frame and the spilled
+// temporaries.
+static Operand local(int offset) {
+  if (omit_fp) {
+    return mem(RSP, offset - 8 + omitted_frame_size(current_fn) + spill * 8);
+  }
+  return mem(RBP, offset);
+}
+
+static Operand sym(char *name) { return (Operand){OP_SYM, .name = name}; }
+
+static Operand label(char *name, long val) {
+  return (Operand){OP_LABEL, .val = val, .name = name};
 }
 
+static Operand global(char *name) { return (Operand){OP_GLOBAL, .name = name}; }
+
+static void emit0(Mnemonic op) { emit_insn(op, none(), none()); }
+
+static void emit1(Mnemonic op, Operand dst) { emit_insn(op, none(), dst); }
+
+static void emit2(Mnemonic op, Operand src, Operand dst) {
+  emit_insn(op, src, dst);
+}
+
+// Saves %rax as a new temporary.
 static void push() {
-  printf("    push %%rax\n");
+  if (depth < NTMP) {
+    emit2(I_MOV, reg(RAX), reg(tmpreg[depth]));
+  } else {
+    emit1(I_PUSH, reg(RAX));
+    spill++;
+  }
   depth++;
 }
 
-static void pop(char *arg) {
-  printf("    pop %s\n", arg);
+// Pops the topmost temporary and returns an operand referring to it.
+// A spilled temporary is returned as (%rsp) and stays on the machine
+// stack until release() is called.
+static Operand pop() {
   depth--;
+  if (depth < NTMP) {
+    return reg(tmpreg[depth]);
+  }
+  return mem(RSP, 0);
 }
 
-static int align_to(int n, int align) {
-  return (n + align - 1) / align * align;
+static void release(Operand opd) {
+  if (opd.kind == OP_MEM) {
+    emit2(I_ADD, imm(8), reg(RSP));
+    spill--;
+  }
 }
-static void gen_addr(Node *node) {
-  switch (node->kind) {
-  case ND_VAR:
-    if (node->var->is_local) {
-      printf("    lea %d(%%rbp),%%rax\n", node->var->offset);
-    } else {
-      printf("    lea %s(%%rip),%%rax\n", node->var->name);
+
+static void push_reg(Reg r) {
+  emit1(I_PUSH, reg(r));
+  spill++;
+}
+
+static void pop_reg(Reg r) {
+  emit1(I_POP, reg(r));
+  spill--;
+}
+
+// Returns a register other than %rax and %rdx that may be clobbered. If
+// all temporaries are live, the last one is saved and *saved is set.
+static Reg scratch(bool *saved) {
+  *saved = false;
+  for (int i = depth; i < NTMP; i++) {
+    if (tmpreg[i] != RDX) {
+      return tmpreg[i];
     }
+  }
+  *saved = true;
+  push_reg(tmpreg[NTMP - 1]);
+  return tmpreg[NTMP - 1];
+}
+
+static void release_scratch(Reg r, bool saved) {
+  if (saved) {
+    pop_reg(r);
+  }
+}
+
+// Multiplies %rax by a constant. A multiplier of the form 2^k * m with
+// m in {1, 3, 5, 9} becomes lea and shl.
+static void gen_mul_const(long c) {
+  unsigned long u = c < 0 ? -(unsigned long)c : c;
+  if (u == 0) {
+    emit2(I_MOV, imm(0), reg(RAX));
     return;
-  case ND_DEREF:
-    gen_expr(node->lhs);
+  }
+  int k = __builtin_ctzl(u);
+  unsigned long m = u >> k;
+  if (m == 1 || m == 3 || m == 5 || m == 9) {
+    if (m > 1) {
+      emit2(I_LEA, mem_index(RAX, RAX, m - 1), reg(RAX));
+    }
+    if (k) {
+      emit2(I_SHL, imm(k), reg(RAX));
+    }
+    if (c < 0) {
+      emit1(I_NEG, reg(RAX));
+    }
+    return;
+  }
+  if (c == (int)c) {
+    emit2(I_IMUL, imm(c), reg(RAX));
     return;
   }
-  error_tok(node->tok, "not an lvalue");
+  bool saved;
+  Reg r = scratch(&saved);
+  emit2(I_MOV, imm(c), reg(r));
+  emit2(I_IMUL, reg(r), reg(RAX));
+  release_scratch(r, saved);
 }
 
-static void load(Type *ty) {
-  if (ty->kind == TY_ARRAY) {
+// Computes the multiplier and shift for signed division by d, where
+// |d| >= 2 is not a power of two (Hacker's Delight, 10-1).
+static void div_magic(long d, long *mul, int *shift) {
+  unsigned long two63 = 1UL << 63;
+  unsigned long ad = d < 0 ? -(unsigned long)d : d;
+  unsigned long t = two63 + ((unsigned long)d >> 63);
+  unsigned long anc = t - 1 - t % ad;
+  int p = 63;
+  unsigned long q1 = two63 / anc;
+  unsigned long r1 = two63 - q1 * anc;
+  unsigned long q2 = two63 / ad;
+  unsigned long r2 = two63 - q2 * ad;
+  unsigned long delta;
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+  *mul = d < 0 ? -(q2 + 1) : q2 + 1;
+  *shift = p - 64;
+}
+
+// Divides %rax by a nonzero constant, rounding towards zero. If the
+// division is known to be exact, it becomes a shift and a multiplication
+// by the inverse of the odd part modulo 2^64.
+static void gen_div_const(long d, bool exact) {
+  unsigned long u = d < 0 ? -(unsigned long)d : d;
+  int k = __builtin_ctzl(u);
+
+  if (exact || u == 1) {
+    if (k) {
+      emit2(I_SAR, imm(k), reg(RAX));
+    }
+    unsigned long m = u >> k;
+    if (m > 1) {
+      unsigned long inv = m;
+      for (int i = 0; i < 5; i++) {
+        inv *= 2 - m * inv;
+      }
+      gen_mul_const(inv);
+    }
+    if (d < 0) {
+      emit1(I_NEG, reg(RAX));
+    }
+    return;
+  }
+
+  bool saved;
+  if (u >> k == 1) {
+    // Add 2^k-1 to a negative dividend so that the shift rounds towards
+    // zero.
+    Reg r = scratch(&saved);
+    emit2(I_MOV, reg(RAX), reg(r));
+    if (k > 1) {
+      emit2(I_SAR, imm(63), reg(r));
+    }
+    emit2(I_SHR, imm(64 - k), reg(r));
+    emit2(I_ADD, reg(r), reg(RAX));
+    emit2(I_SAR, imm(k), reg(RAX));
+    release_scratch(r, saved);
+    if (d < 0) {
+      emit1(I_NEG, reg(RAX));
+    }
     return;
   }
+
+  // Take the high half of the product with the magic number, then add 1
+  // if the quotient is negative.
+  long mul;
+  int shift;
+  div_magic(d, &mul, &shift);
+  bool save_rdx = depth > 2;
+  if (save_rdx) {
+    push_reg(RDX);
+  }
+  Reg r = scratch(&saved);
+  emit2(I_MOV, reg(RAX), reg(r));
+  emit2(I_MOV, imm(mul), reg(RAX));
+  emit1(I_IMUL, reg(r));
+  if (d > 0 && mul < 0) {
+    emit2(I_ADD, reg(r), reg(RDX));
+  } else if (d < 0 && mul > 0) {
+    emit2(I_SUB, reg(r), reg(RDX));
+  }
+  if (shift) {
+    emit2(I_SAR, imm(shift), reg(RDX));
+  }
+  emit2(I_MOV, reg(RDX), reg(RAX));
+  emit2(I_SHR, imm(63), reg(RAX));
+  emit2(I_ADD, reg(RDX), reg(RAX));
+  release_scratch(r, saved);
+  if (save_rdx) {
+    pop_reg(RDX);
+  }
+}
+
+static int align_to(int n, int align) {
+  return (n + align - 1) / align * align;
+}
+static Operand var_mem(Obj *var) {
+  return var->is_local ? local(var->offset) : sym(var->name);
+}
+
+static void load(Type *ty) {
   if (ty->size == 1) {
-    printf("    movsbq (%%rax),%%rax\n");
+    emit2(I_MOVSBQ, mem(RAX, 0), reg(RAX));
   } else {
-    printf("    mov (%%rax),%%rax\n");
+    emit2(I_MOV, mem(RAX, 0), reg(RAX));
   }
 }
 
 static void store(Type *ty) {
-  pop("%rdi");
+  Operand addr = pop();
+  // A spilled address means every temporary register is live, so borrow
+  // the last one and put its value back afterwards.
+  bool spilled = addr.kind == OP_MEM;
+  if (spilled) {
+    emit2(I_XCHG, mem(RSP, 0), reg(tmpreg[NTMP - 1]));
+    addr = reg(tmpreg[NTMP - 1]);
+  }
   if (ty->size == 1) {
-    printf("    mov %%al,(%%rdi)\n");
+    emit2(I_MOV, reg8(RAX), mem(addr.reg, 0));
   } else {
-    printf("    mov %%rax,(%%rdi)\n");
+    emit2(I_MOV, reg(RAX), mem(addr.reg, 0));
+  }
+  if (spilled) {
+    pop_reg(addr.reg);
   }
 }
-static void gen_expr(Node *node) {
-  switch (node->kind) {
-  case ND_NUM:
-    printf("    mov $%d,%%rax\n", node->val);
-    return;
-  case ND_NEG:
-    gen_expr(node->lhs);
-    printf("    neg %%rax\n");
-    return;
-  case ND_VAR:
-    gen_addr(node);
-    load(node->ty);
-    return;
-  case ND_ASSIGN:
-    gen_addr(node->lhs);
-    push();
-    gen_expr(node->rhs);
-    store(node->ty);
-    return;
-  case ND_STMT_EXPR:
-    for (Node *n = node->body; n; n = n->next) {
-      gen_stmt(n);
+
+static void gen_tree(Value *v);
+
+// Loads a value into %rax: a constant, the content of its home, or else
+// the value computed from its operands.
+static void gen_value(Value *v) {
+  if (v->lat == CONST) {
+    emit2(I_MOV, imm(v->cval), reg(RAX));
+  } else if (v->home) {
+    emit2(I_MOV, var_mem(v->home), reg(RAX));
+  } else {
+    gen_tree(v);
+  }
+}
+
+// Evaluates an argument that needs no temporaries, i.e. a constant, a
+// value in its home, a variable or the address of one, straight into r.
+// Returns false for any other argument.
+static bool gen_simple_arg(Value *v, Reg r) {
+  if (v->lat == CONST) {
+    emit2(I_MOV, imm(v->cval), reg(r));
+    return true;
+  }
+  if (v->home) {
+    emit2(I_MOV, var_mem(v->home), reg(r));
+    return true;
+  }
+  switch (v->kind) {
+  case V_PARAM:
+    emit2(v->var->ty->size == 1 ? I_MOVSBQ : I_MOV, var_mem(v->var), reg(r));
+    return true;
+  case V_ADDR:
+    emit2(I_LEA, var_mem(v->var), reg(r));
+    return true;
+  case V_LOAD:
+    if (v->args[0]->kind == V_ADDR) {
+      emit2(v->ty->size == 1 ? I_MOVSBQ : I_MOV, var_mem(v->args[0]->var),
+            reg(r));
+      return true;
     }
-    return;
-  case ND_DEREF:
-    gen_expr(node->lhs);
-    load(node->ty);
-    return;
-  case ND_ADDR:
-    gen_addr(node->lhs);
-    return;
-  case ND_FUNCALL:
-    int nargs = 0;
-    for (Node *arg = node->args; arg; arg = arg->next) {
-      gen_expr(arg);
+  }
+  return false;
+}
+
+// Evaluates the arguments of a call: the first six into the argument
+// registers, the rest onto the stack. Returns the number of bytes pushed,
+// including padding that keeps %rsp 16-byte aligned at the call.
+static int gen_args(Value *call) {
+  int nargs = call->nargs;
+  int nstack = nargs > NARGREG ? nargs - NARGREG : 0;
+  int live = depth;
+  depth = 0;
+
+  // Stack arguments are pushed from the last one, so that the seventh
+  // ends up right above the return address.
+  int pad = (spill + nstack) % 2;
+  if (pad) {
+    emit2(I_SUB, imm(8), reg(RSP));
+    spill++;
+  }
+  for (int i = nargs - 1; i >= NARGREG; i--) {
+    gen_value(call->args[i]);
+    push_reg(RAX);
+  }
+
+  // Each register argument becomes the i-th temporary, i.e. lands in
+  // argreg[i]. A later argument that makes a call saves the earlier ones.
+  for (int i = 0; i < nargs && i < NARGREG; i++) {
+    if (gen_simple_arg(call->args[i], argreg[i])) {
+      depth++;
+    } else {
+      gen_value(call->args[i]);
       push();
-      nargs++;
     }
+  }
+  depth = live;
+  return (nstack + pad) * 8;
+}
+
+// Generates a call in tail position. The frame is torn down before
+// jumping to the callee, which then returns directly to our caller.
+static void gen_sibling_call(Value *call) {
+  spill -= gen_args(call) / 8;
+  emit2(I_MOV, reg(RBP), reg(RSP));
+  emit1(I_POP, reg(RBP));
+  emit2(I_MOV, imm(0), reg(RAX));
+  emit1(I_JMP, global(call->funcname));
+}
 
-    for (int i = nargs - 1; i >= 0; i--) {
-      pop(argreg64[i]);
+static void gen_call(Value *call) {
+  // Temporaries of the enclosing expression are clobbered by the call.
+  int saved = depth < NTMP ? depth : NTMP;
+  for (int i = 0; i < saved; i++) {
+    push_reg(tmpreg[i]);
+  }
+  int stack = gen_args(call);
+  emit2(I_MOV, imm(0), reg(RAX));
+  emit1(I_CALL, global(call->funcname));
+  if (stack) {
+    emit2(I_ADD, imm(stack), reg(RSP));
+    spill -= stack / 8;
+  }
+
+  for (int i = saved - 1; i >= 0; i--) {
+    pop_reg(tmpreg[i]);
+  }
+}
+
+static void gen_binary(Value *v) {
+  Value *lhs = v->args[0];
+  Value *rhs = v->args[1];
+
+  // Multiplication and division by constants
+  if ((v->op == ND_MUL || v->op == ND_DIV) && rhs->lat == CONST &&
+      rhs->cval != 0) {
+    gen_value(lhs);
+    if (v->op == ND_MUL) {
+      gen_mul_const(rhs->cval);
+    } else {
+      gen_div_const(rhs->cval, v->is_exact);
     }
-    printf("    mov $0,%%rax\n");
-    printf("    call %s\n", node->funcname);
+    return;
+  }
+  if (v->op == ND_MUL && lhs->lat == CONST) {
+    gen_value(rhs);
+    gen_mul_const(lhs->cval);
     return;
   }
 
-  gen_expr(node->rhs);
+  gen_value(rhs);
   push();
-  gen_expr(node->lhs);
-  pop("%rdi");
+  gen_value(lhs);
+  Operand rd = pop();
 
-  switch (node->kind) {
+  switch (v->op) {
   case ND_ADD:
-    printf("    add %%rdi,%%rax\n");
+    emit2(I_ADD, rd, reg(RAX));
+    release(rd);
     return;
   case ND_SUB:
-    printf("    sub %%rdi,%%rax\n");
+    emit2(I_SUB, rd, reg(RAX));
+    release(rd);
     return;
   case ND_MUL:
-    printf("    imul %%rdi,%%rax\n");
+    emit2(I_IMUL, rd, reg(RAX));
+    release(rd);
     return;
-  case ND_DIV:
-    printf("    cqo\n");
-    printf("    idiv %%rdi\n");
+  case ND_DIV: {
+    // cqo overwrites %rdx, which may hold the divisor or a live temporary.
+    Operand divisor = rd;
+    bool save_rdx = depth >= 2;
+    if (save_rdx) {
+      push_reg(RDX);
+      if (depth == 2) {
+        divisor = mem(RSP, 0);
+      } else if (depth >= NTMP) {
+        divisor = mem(RSP, 8);
+      }
+    }
+    emit0(I_CQO);
+    emit1(I_IDIV, divisor);
+    if (save_rdx) {
+      pop_reg(RDX);
+    }
+    release(rd);
     return;
+  }
   case ND_EQ:
   case ND_NE:
   case ND_LT:
   case ND_LE:
-    printf("    cmp %%rdi,%%rax\n");
-    if (node->kind == ND_EQ) {
-      printf("    sete %%al\n");
-    } else if (node->kind == ND_NE) {
-      printf("    setne %%al\n");
-    } else if (node->kind == ND_LT) {
-      printf("    setl %%al\n");
-    } else if (node->kind == ND_LE) {
-      printf("    setle %%al\n");
-    }
-    printf("    movzb %%al,%%rax\n");
+    // The temp is released after setcc: freeing a spilled one adjusts
+    // %rsp, which clobbers the flags.
+    emit2(I_CMP, rd, reg(RAX));
+    if (v->op == ND_EQ) {
+      emit1(I_SETE, reg8(RAX));
+    } else if (v->op == ND_NE) {
+      emit1(I_SETNE, reg8(RAX));
+    } else if (v->op == ND_LT) {
+      emit1(I_SETL, reg8(RAX));
+    } else if (v->op == ND_LE) {
+      emit1(I_SETLE, reg8(RAX));
+    }
+    emit2(I_MOVZB, reg8(RAX), reg(RAX));
+    release(rd);
+    return;
+  }
+  error("invalid expression");
+}
+
+// Computes a value from its operands into %rax.
+static void gen_tree(Value *v) {
+  switch (v->kind) {
+  case V_CONST:
+    emit2(I_MOV, imm(v->val), reg(RAX));
+    return;
+  case V_PARAM:
+    emit2(v->var->ty->size == 1 ? I_MOVSBQ : I_MOV, var_mem(v->var),
+          reg(RAX));
+    return;
+  case V_ADDR:
+    emit2(I_LEA, var_mem(v->var), reg(RAX));
+    return;
+  case V_LOAD:
+    if (v->args[0]->kind == V_ADDR) {
+      emit2(v->ty->size == 1 ? I_MOVSBQ : I_MOV, var_mem(v->args[0]->var),
+            reg(RAX));
+      return;
+    }
+    gen_value(v->args[0]);
+    load(v->ty);
+    return;
+  case V_STORE:
+    if (v->args[0]->kind == V_ADDR) {
+      gen_value(v->args[1]);
+      Operand dst = var_mem(v->args[0]->var);
+      emit2(I_MOV, v->ty->size == 1 ? reg8(RAX) : reg(RAX), dst);
+      return;
+    }
+    gen_value(v->args[0]);
+    push();
+    gen_value(v->args[1]);
+    store(v->ty);
+    return;
+  case V_CALL:
+    gen_call(v);
+    return;
+  case V_NEG:
+    gen_value(v->args[0]);
+    emit1(I_NEG, reg(RAX));
     return;
+  case V_SEXT8:
+    gen_value(v->args[0]);
+    emit2(I_MOVSBQ, reg8(RAX), reg(RAX));
+    return;
+  case V_BINARY:
+    gen_binary(v);
+    return;
+  }
+  error("invalid value");
+}
+#define MAX_ALIGN 16
+
+// Places a local right below the given number of bytes of the frame,
+// aligned for its type, and returns the new extent of the frame.
+static int place_var(Obj *var, int offset) {
+  offset = align_to(offset + var->ty->size, var->ty->align);
+  var->offset = -offset;
+  return offset;
+}
+
+// Places the locals of a block, the most aligned first so that little
+// padding is needed.
+static int place_scope(Obj *vars, int offset) {
+  for (int align = MAX_ALIGN; align; align /= 2) {
+    for (Obj *var = vars; var; var = var->scope_next) {
+      if (var->ty->align == align && !var->is_promoted) {
+        offset = place_var(var, offset);
+      }
+    }
   }
-  error_tok(node->tok, "invalid expression");
+  return offset;
 }
+
+// Places the locals of the blocks in a subtree below the given number of
+// bytes of the frame and returns the extent of the frame. The locals of
+// a block follow those of the enclosing blocks, while blocks that don't
+// nest are never live at the same time and share their space.
+static int place_blocks(Node *node, int offset) {
+  int end = offset;
+  for (; node; node = node->next) {
+    int base = offset;
+    if (node->kind == ND_BLOCK || node->kind == ND_STMT_EXPR) {
+      base = place_scope(node->locals, offset);
+    }
+    Node *kids[] = {node->lhs,  node->rhs, node->cond, node->then, node->els,
+                    node->init, node->inc, node->body, node->args};
+    int ext = base;
+    for (int i = 0; i < sizeof(kids) / sizeof(*kids); i++) {
+      int n = place_blocks(kids[i], base);
+      ext = n > ext ? n : ext;
+    }
+    end = ext > end ? ext : end;
+  }
+  return end;
+}
+
 static void assign_lvar_offsets(Obj *prog) {
   for (Obj *fn = prog; fn; fn = fn->next) {
     if (!fn->is_function) {
       continue;
     }
-    int offset = 0;
-    for (Obj *var = fn->locals; var; var = var->next) {
-      offset += var->ty->size;
-      var->offset = -offset;
+    // Parameters past the sixth are passed on the stack, above the
+    // return address. Being the last locals, they end the list.
+    Obj *stack_params = fn->params;
+    for (int i = 0; stack_params && i < NARGREG; i++) {
+      stack_params = stack_params->next;
+    }
+    int offset = 16;
+    for (Obj *var = stack_params; var; var = var->next) {
+      var->offset = offset;
+      offset += 8;
+    }
+
+    for (Obj *var = fn->locals; var != stack_params; var = var->next) {
+      var->offset = 0;
+    }
+    offset = place_blocks(fn->body, 0);
+
+    // Parameters and the locals that were added by optimizations live
+    // in the whole function.
+    for (int align = MAX_ALIGN; align; align /= 2) {
+      for (Obj *var = fn->locals; var != stack_params; var = var->next) {
+        if (!var->offset && !var->is_promoted && var->ty->align == align) {
+          offset = place_var(var, offset);
+        }
+      }
     }
     fn->stack_size = align_to(offset, 16);
   }
 }
 
-void gen_stmt(Node *node) {
-  int c = 0;
-  switch (node->kind) {
-  case ND_RETURN:
-    gen_expr(node->lhs);
-    printf("    jmp .L.return.%s\n", current_fn->name);
-    return;
-  case ND_EXPR_STMT:
-    gen_expr(node->lhs);
-    return;
-  case ND_BLOCK:
-    for (Node *n = node->body; n; n = n->next) {
-      gen_stmt(n);
+// Reports whether computing v reads the home of phi.
+static bool reads(Value *v, Value *phi) {
+  if (v == phi) {
+    return true;
+  }
+  if (!v->inlined) {
+    return false;
+  }
+  for (int i = 0; i < v->nargs; i++) {
+    if (reads(v->args[i], phi)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Stores the operands coming from bb to the homes of the phis of its
+// successor. They are copied one by one, unless one of them reads a phi
+// whose home is overwritten before it; then all of them are computed
+// into temporaries first.
+static void gen_phi_copies(Block *bb) {
+  Block *succ = bb->succs[0];
+  int k = 0;
+  while (succ->preds[k].from != bb) {
+    k++;
+  }
+  bool direct = true;
+  for (int i = 0; i < succ->nvalues && direct; i++) {
+    Value *phi = succ->values[i];
+    if (phi->kind != V_PHI || !phi->home) {
+      continue;
+    }
+    for (int j = i + 1; j < succ->nvalues; j++) {
+      Value *v = succ->values[j];
+      if (v->kind == V_PHI && v->home && v->args[k] != v &&
+          reads(v->args[k], phi)) {
+        direct = false;
+        break;
+      }
+    }
+  }
+
+  int n = 0;
+  for (int i = 0; i < succ->nvalues; i++) {
+    Value *phi = succ->values[i];
+    if (phi->kind != V_PHI || !phi->home || phi->args[k] == phi) {
+      continue;
+    }
+    gen_value(phi->args[k]);
+    if (direct) {
+      emit2(I_MOV, reg(RAX), var_mem(phi->home));
+    } else {
+      push();
+      n++;
+    }
+  }
+  for (int i = succ->nvalues - 1; n && i >= 0; i--) {
+    Value *phi = succ->values[i];
+    if (phi->kind != V_PHI || !phi->home || phi->args[k] == phi) {
+      continue;
+    }
+    n--;
+    Operand t = pop();
+    if (t.kind == OP_MEM) {
+      pop_reg(RAX);
+      t = reg(RAX);
+    }
+    emit2(I_MOV, t, var_mem(phi->home));
+  }
+}
+
+// Reports whether control reaches bb from the block emitted before it by
+// falling through.
+static bool falls_into(Block *prev, Block *bb) {
+  if (!prev || !is_exec(prev, bb)) {
+    return false;
+  }
+  Value *term = prev->term;
+  return !term || term->kind != V_BRANCH || prev->succs[0] == bb ||
+         !is_exec(prev, prev->succs[0]);
+}
+
+static bool needs_label(Block *prev, Block *bb) {
+  for (int i = 0; i < bb->npreds; i++) {
+    if (bb->preds[i].exec &&
+        (bb->preds[i].from != prev || !falls_into(prev, bb))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Jumps to a block unless it is emitted next.
+static void gen_jump(Block *to, Block *next) {
+  if (to != next) {
+    emit1(I_JMP, label(".L.bb.", to->id));
+  }
+}
+
+// Emits a basic block. Values that are computed in place are those with
+// a home and those with a side effect; the rest are part of the trees of
+// their users.
+static void gen_block(Block *bb, Block *prev, Block *next) {
+  if (needs_label(prev, bb)) {
+    emit1(I_LABEL, label(".L.bb.", bb->id));
+  }
+  for (int i = 0; i < bb->nvalues; i++) {
+    Value *v = bb->values[i];
+    if (!v->live || v->inlined || is_remat(v) || v->kind == V_PHI ||
+        v == bb->term) {
+      continue;
+    }
+    if (!v->home && v->kind != V_STORE && v->kind != V_CALL) {
+      continue;
+    }
+    gen_tree(v);
+    if (v->home) {
+      emit2(I_MOV, reg(RAX), var_mem(v->home));
     }
-    return;
-  case ND_IF:
-    c = count();
-    gen_expr(node->cond);
-    printf("    cmp $0,%%rax\n");
-    printf("    je .L.else.%d\n", c);
-    gen_stmt(node->then);
-    printf("    jmp .L.end.%d\n", c);
-    printf(".L.else.%d:\n", c);
-    if (node->els) {
-      gen_stmt(node->els);
-    }
-    printf(".L.end.%d:\n", c);
-    return;
-  case ND_FOR:
-    c = count();
-    if (node->init)
-      gen_stmt(node->init);
-    printf(".L.begin.%d:\n", c);
-    if (node->cond) {
-      gen_expr(node->cond);
-      printf("    cmp $0,%%rax\n");
-      printf("    je .L.end.%d\n", c);
-    }
-    gen_stmt(node->then);
-    if (node->inc)
-      gen_expr(node->inc);
-    printf("    jmp .L.begin.%d\n", c);
-    printf(".L.end.%d:\n", c);
-    return;
   }
-  error_tok(node->tok, "invalid statement");
+
+  Value *term = bb->term;
+  if (!term) {
+    if (bb->nsuccs == 1) {
+      gen_phi_copies(bb);
+      gen_jump(bb->succs[0], next);
+    } else if (next) {
+      emit1(I_JMP, label(".L.return.", -1));
+    }
+  } else if (term->kind == V_RET) {
+    // Arguments on the stack would live in the frame being torn down.
+    Value *arg = term->args[0];
+    if (sibling_calls && arg->kind == V_CALL && arg->inlined &&
+        arg->nargs <= NARGREG) {
+      gen_sibling_call(arg);
+    } else {
+      gen_value(arg);
+      if (next) {
+        emit1(I_JMP, label(".L.return.", -1));
+      }
+    }
+  } else if (is_exec(bb, bb->succs[0]) && is_exec(bb, bb->succs[1])) {
+    gen_value(term->args[0]);
+    emit2(I_CMP, imm(0), reg(RAX));
+    emit1(I_JE, label(".L.bb.", bb->succs[1]->id));
+    gen_jump(bb->succs[0], next);
+  } else {
+    gen_jump(bb->succs[is_exec(bb, bb->succs[0]) ? 0 : 1], next);
+  }
+  assert(depth == 0 && spill == 0);
+}
+
+// Emits the reachable blocks in the order of the source.
+static void gen_blocks(Obj *fn) {
+  Block *prev = NULL;
+  for (int i = 0; i < fn->nblocks; i++) {
+    Block *bb = fn->blocks[i];
+    if (!bb->reachable) {
+      continue;
+    }
+    Block *next = NULL;
+    for (int j = i + 1; j < fn->nblocks && !next; j++) {
+      if (fn->blocks[j]->reachable) {
+        next = fn->blocks[j];
+      }
+    }
+    gen_block(bb, prev, next);
+    prev = bb;
+  }
+}
+// String literals are local to the file. Those without an embedded NUL
+// go to a mergeable section, in which the linker can also share them
+// with identical strings of other files.
+static void emit_literal_section(Obj *var) {
+  if (memchr(var->init_data, '\0', var->ty->size - 1)) {
+    emit_directive(".section", ".rodata");
+  } else {
+    emit_directive(".section", ".rodata.str1.1,\"aMS\",@progbits,1");
+  }
 }
+
+// Emits initialized data as runs of .ascii and .zero.
+static void emit_bytes(char *p, int len) {
+  char *buf = malloc(len * 4 + 3);
+  for (int i = 0; i < len;) {
+    int start = i;
+    if (!p[i]) {
+      while (i < len && !p[i]) {
+        i++;
+      }
+      emit_directive_num(".zero", i - start);
+      continue;
+    }
+
+    char *q = buf;
+    *q++ = '"';
+    for (; i < len && p[i]; i++) {
+      unsigned char c = p[i];
+      if (c == '"' || c == '\\' || !isprint(c)) {
+        q += sprintf(q, "\\%03o", c);
+      } else {
+        *q++ = c;
+      }
+    }
+    *q++ = '"';
+    *q = '\0';
+    emit_directive(".ascii", buf);
+  }
+  free(buf);
+}
+
 static void emit_data(Obj *prog) {
   for (Obj *var = prog; var; var = var->next) {
     if (var->is_function)
       continue;
-    printf("    .data\n");
-    printf("    .global %s\n", var->name);
-    printf("%s:\n", var->name);
+    if (var->is_literal) {
+      emit_literal_section(var);
+    } else if (var->init_data) {
+      emit_directive(".data", NULL);
+    } else {
+      // Zero-initialized data takes no space in the file.
+      emit_directive(".bss", NULL);
+    }
+    if (!var->is_literal) {
+      emit_directive(".global", var->name);
+    }
+    if (var->ty->align > 1) {
+      emit_directive_num(".align", var->ty->align);
+    }
+    emit1(I_LABEL, global(var->name));
     if (var->init_data) {
-      for (int i = 0; i < var->ty->size; i++) {
-        printf("    .byte %d\n", var->init_data[i]);
+      emit_bytes(var->init_data, var->ty->size);
+    } else {
+      emit_directive_num(".zero", var->ty->size);
+    }
+  }
+}
+static bool has_call(Obj *fn) {
+  for (int i = 0; i < fn->nblocks; i++) {
+    Block *bb = fn->blocks[i];
+    for (int j = 0; bb->reachable && j < bb->nvalues; j++) {
+      if (bb->values[j]->kind == V_CALL && bb->values[j]->live) {
+        return true;
       }
+    }
+  }
+  return false;
+}
+
+static void emit_function(Obj *fn) {
+  emit_directive(".globl", fn->name);
+  emit_directive(".text", NULL);
+  emit1(I_LABEL, global(fn->name));
+  current_fn = fn;
+  // The callee of a sibling call must not see our frame.
+  sibling_calls = opt_foptimize_sibling_calls && !find_escape(fn->body);
+  // A leaf function needs no aligned stack, so it does without a frame
+  // pointer, and without any prologue if it has no locals either.
+  omit_fp = opt_fomit_frame_pointer && !has_call(fn);
+  // Prologue
+  int frame = omit_fp ? omitted_frame_size(fn) : fn->stack_size;
+  if (!omit_fp) {
+    emit1(I_PUSH, reg(RBP));
+    emit2(I_MOV, reg(RSP), reg(RBP));
+  }
+  if (frame) {
+    emit2(I_SUB, imm(frame), reg(RSP));
+  }
+  // Save passed-by-register arguments to the stack
+  int i = 0;
+  for (Obj *var = fn->params; var && i < NARGREG; var = var->next) {
+    if (var->ty->size == 1) {
+      emit2(I_MOV, reg8(argreg[i++]), local(var->offset));
     } else {
-      printf("    .zero %d\n", var->ty->size);
+      emit2(I_MOV, reg(argreg[i++]), local(var->offset));
     }
   }
+  // Emit code
+  gen_blocks(fn);
+  // Epilogue
+  emit1(I_LABEL, label(".L.return.", -1));
+  if (!omit_fp) {
+    emit2(I_MOV, reg(RBP), reg(RSP));
+    emit1(I_POP, reg(RBP));
+  } else if (frame) {
+    emit2(I_ADD, imm(frame), reg(RSP));
+  }
+  emit0(I_RET);
+}
+
+// Functions are handed out to the worker threads in list order. Each
+// one is generated into its own in-memory output, and the outputs are
+// concatenated in the same order, so the result doesn't depend on the
+// number of threads.
+static struct {
+  Obj **fns;
+  Output **outs;
+  int nfns;
+  int next;
+} tasks;
+
+static void gen_task(int i) {
+  Obj *fn = tasks.fns[i];
+  Output *o = tasks.outs[i] = output_new(fn->name);
+  emit_to(o);
+  if (fn->cached) {
+    emit_replay(fn->cached, fn->cached_len);
+    emit_to(NULL);
+    return;
+  }
+  if (opt_cache) {
+    output_record(o);
+  }
+  emit_function(fn);
+  emit_to(NULL);
+  if (opt_cache) {
+    int len;
+    char *buf = output_recording(o, &len);
+    cache_store(fn, buf, len);
+  }
 }
+
+static void *worker(void *arg) {
+  for (;;) {
+    int i = __atomic_fetch_add(&tasks.next, 1, __ATOMIC_RELAXED);
+    if (i >= tasks.nfns) {
+      return NULL;
+    }
+    gen_task(i);
+  }
+}
+
 static void emit_text(Obj *prog) {
+  int nfns = 0;
   for (Obj *fn = prog; fn; fn = fn->next) {
-    if (!fn->is_function) {
-      continue;
+    nfns += fn->is_function;
+  }
+  tasks.fns = calloc(nfns, sizeof(Obj *));
+  tasks.outs = calloc(nfns, sizeof(Output *));
+  tasks.nfns = nfns;
+  tasks.next = 0;
+  int n = 0;
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (fn->is_function) {
+      tasks.fns[n++] = fn;
     }
-    printf("    .globl %s\n", fn->name);
-    printf("    .text\n");
-    printf("%s:\n", fn->name);
-    current_fn = fn;
-    // Prologue
-    printf("    push %%rbp\n");
-    printf("    mov %%rsp, %%rbp\n");
-    printf("    sub $%d, %%rsp\n", fn->stack_size);
-    // Save passed-by-register arguments to the stack
-    int i = 0;
-    for (Obj *var = fn->params; var; var = var->next) {
-      if (var->ty->size == 1) {
-        printf("    mov %s,%d(%%rbp)\n", argreg8[i++], var->offset);
-      } else {
-        printf("    mov %s,%d(%%rbp)\n", argreg64[i++], var->offset);
+  }
+
+  int nthreads = opt_fthreads < nfns ? opt_fthreads : nfns;
+  if (nthreads <= 1) {
+    // Write out each function as soon as it's done.
+    for (int i = 0; i < nfns; i++) {
+      gen_task(i);
+      emit_output(tasks.outs[i]);
+    }
+  } else {
+    pthread_t *threads = calloc(nthreads - 1, sizeof(pthread_t));
+    for (int i = 0; i < nthreads - 1; i++) {
+      if (pthread_create(&threads[i], NULL, worker, NULL)) {
+        error("cannot create codegen thread");
       }
     }
-    // Emit code
-    gen_stmt(fn->body);
-    assert(depth == 0);
-    // Epilogue
-    printf(".L.return.%s:\n", fn->name);
-    printf("    mov %%rbp, %%rsp\n");
-    printf("    pop %%rbp\n");
-    printf("    ret\n");
+    worker(NULL);
+    for (int i = 0; i < nthreads - 1; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    for (int i = 0; i < nfns; i++) {
+      emit_output(tasks.outs[i]);
+    }
   }
+  free(tasks.fns);
+  free(tasks.outs);
 }
 void codegen(Obj *prog) {
   assign_lvar_offsets(prog);
   emit_data(prog);
   emit_text(prog);
+  emit_flush();
 }
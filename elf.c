@@ -0,0 +1,716 @@
+#include "ycc.h"
+#include <assert.h>
+#include <elf.h>
+#include <stdint.h>
+
+// With -c, instructions and directives are encoded into machine code as
+// they are emitted and written out as an ELF64 relocatable object, so no
+// assembler is needed. Like text output, each function is encoded into
+// an Object of its own; local labels are resolved within that object,
+// and objects are then appended to the one for the output file.
+
+typedef enum {
+  SEC_TEXT,
+  SEC_DATA,
+  SEC_RODATA,
+  SEC_RODATA_STR, // Mergeable NUL-terminated strings
+  SEC_BSS,
+  NSECS,
+} SectionId;
+
+typedef struct {
+  char *name;
+  int type;
+  int flags;
+  int align;
+  int entsize;
+} SectionInfo;
+
+// A section of type SHT_NOBITS has a size but no contents.
+static SectionInfo sec_info[] = {
+    [SEC_TEXT] = {".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16},
+    [SEC_DATA] = {".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 8},
+    [SEC_RODATA] = {".rodata", SHT_PROGBITS, SHF_ALLOC, 8},
+    [SEC_RODATA_STR] = {".rodata.str1.1", SHT_PROGBITS,
+                        SHF_ALLOC | SHF_MERGE | SHF_STRINGS, 1, 1},
+    [SEC_BSS] = {".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE, 8},
+};
+
+typedef struct {
+  char *buf;
+  int len;
+  int cap;
+} Buf;
+
+typedef struct {
+  SectionId sec;
+  int offset;
+  char *sym;
+  int type;
+  long addend;
+} Reloc;
+
+// A rel32 field to be filled in with the distance to a local label.
+typedef struct {
+  int offset;
+  char *label;
+} Fixup;
+
+typedef struct {
+  char *name;
+  int sec; // -1 if undefined
+  int offset;
+  bool global;
+  int index; // Index in .symtab
+} Symbol;
+
+struct Object {
+  Buf secs[NSECS];
+  SectionId cur; // Current section
+  Reloc *relocs;
+  int nrelocs;
+  int relocs_cap;
+  Fixup *fixups;
+  int nfixups;
+  int fixups_cap;
+  HashMap labels; // Local label -> offset in .text + 1
+  Symbol **syms;  // In order of first appearance
+  int nsyms;
+  int syms_cap;
+  HashMap symmap; // Name -> Symbol
+};
+
+static void *grow(void *p, int *cap, int n, size_t size) {
+  if (n <= *cap) {
+    return p;
+  }
+  while (*cap < n) {
+    *cap = *cap ? *cap * 2 : 16;
+  }
+  p = realloc(p, *cap * size);
+  if (!p) {
+    error("out of memory");
+  }
+  return p;
+}
+
+static void buf_append(Buf *b, void *p, int len) {
+  b->buf = grow(b->buf, &b->cap, b->len + len, 1);
+  memcpy(b->buf + b->len, p, len);
+  b->len += len;
+}
+
+static void buf_zero(Buf *b, int len) {
+  b->buf = grow(b->buf, &b->cap, b->len + len, 1);
+  memset(b->buf + b->len, 0, len);
+  b->len += len;
+}
+
+Object *obj_new(void) {
+  Object *obj = calloc(1, sizeof(Object));
+  obj->cur = SEC_TEXT;
+  return obj;
+}
+
+static Symbol *get_symbol(Object *obj, char *name) {
+  int len = strlen(name);
+  Symbol *sym = hashmap_get(&obj->symmap, name, len);
+  if (sym) {
+    return sym;
+  }
+  sym = calloc(1, sizeof(Symbol));
+  sym->name = name;
+  sym->sec = -1;
+  hashmap_put(&obj->symmap, name, len, sym);
+  obj->syms = grow(obj->syms, &obj->syms_cap, obj->nsyms + 1, sizeof(Symbol *));
+  obj->syms[obj->nsyms++] = sym;
+  return sym;
+}
+
+static void define_symbol(Object *obj, char *name, int sec, int offset) {
+  Symbol *sym = get_symbol(obj, name);
+  if (sym->sec != -1) {
+    error("symbol defined twice: %s", name);
+  }
+  sym->sec = sec;
+  sym->offset = offset;
+}
+
+static void add_reloc(Object *obj, SectionId sec, int offset, char *sym,
+                      int type, long addend) {
+  get_symbol(obj, sym);
+  obj->relocs =
+      grow(obj->relocs, &obj->relocs_cap, obj->nrelocs + 1, sizeof(Reloc));
+  obj->relocs[obj->nrelocs++] = (Reloc){sec, offset, sym, type, addend};
+}
+
+// Returns the text a local label is printed as, which serves as its key.
+static char *label_name(Operand *op) {
+  int len = snprintf(NULL, 0, "%s.%ld", op->name, op->val);
+  char *buf = malloc(len + 1);
+  if (op->val >= 0) {
+    snprintf(buf, len + 1, "%s.%ld", op->name, op->val);
+  } else {
+    strcpy(buf, op->name);
+  }
+  return buf;
+}
+
+//
+// Instruction encoding
+//
+
+static Buf *section(Object *obj) { return &obj->secs[obj->cur]; }
+
+static void byte(Object *obj, int b) {
+  char c = b;
+  buf_append(section(obj), &c, 1);
+}
+
+// Appends n zero bytes to the current section.
+static void zero(Object *obj, int n) {
+  if (sec_info[obj->cur].type == SHT_NOBITS) {
+    section(obj)->len += n;
+  } else {
+    buf_zero(section(obj), n);
+  }
+}
+
+// Appends the contents of a string in double quotes, as printed for
+// .ascii, with characters escaped as \ooo.
+static void ascii(Object *obj, char *s) {
+  for (s++; *s != '"'; s++) {
+    int c = *s;
+    if (c == '\\') {
+      c = 0;
+      for (int i = 0; i < 3 && '0' <= s[1] && s[1] <= '7'; i++) {
+        c = c * 8 + *++s - '0';
+      }
+    }
+    byte(obj, c);
+  }
+}
+
+static void imm32(Object *obj, long val) {
+  uint32_t v = val;
+  buf_append(section(obj), &v, 4);
+}
+
+static void imm64(Object *obj, long val) { buf_append(section(obj), &val, 8); }
+
+static bool is_int8(long val) { return val == (int8_t)val; }
+static bool is_int32(long val) { return val == (int32_t)val; }
+
+// Byte registers numbered 4-7 are %spl, %bpl, %sil and %dil only with a
+// REX prefix; without one they would be %ah, %ch, %dh and %bh.
+static bool needs_rex8(Operand *op) {
+  return op->kind == OP_REG && op->size == 1 && op->reg >= 4;
+}
+
+// Encodes an instruction with a ModRM byte: REX prefix, opcode (one
+// byte, or 0x0f and a second byte), then ModRM, SIB and displacement
+// for rm. reg is the register in the ModRM reg field or an opcode
+// extension. imm is the number of immediate bytes the caller appends,
+// which a RIP-relative displacement is relative to.
+static void encode_rm(Object *obj, int opcode, bool w, Operand *reg,
+                      int ext, Operand *rm, int imm) {
+  int r = reg ? reg->reg : ext;
+  int base = rm->kind == OP_SYM ? 0 : rm->reg;
+  bool sib = rm->kind == OP_MEM && ((base & 7) == RSP || rm->scale);
+  int index = rm->kind == OP_MEM && rm->scale ? rm->index : RSP;
+  int rex = 0x40 | (w ? 8 : 0) | (r >= 8 ? 4 : 0) | (index >= 8 ? 2 : 0) |
+            (base >= 8 ? 1 : 0);
+  if (rex != 0x40 || (reg && needs_rex8(reg)) || needs_rex8(rm)) {
+    byte(obj, rex);
+  }
+  if (opcode > 0xff) {
+    byte(obj, opcode >> 8);
+  }
+  byte(obj, opcode);
+
+  r &= 7;
+  if (rm->kind == OP_REG) {
+    byte(obj, 0xc0 | r << 3 | (base & 7));
+    return;
+  }
+  if (rm->kind == OP_SYM) {
+    byte(obj, r << 3 | 5);
+    add_reloc(obj, obj->cur, section(obj)->len, rm->name, R_X86_64_PC32,
+              -4 - imm);
+    imm32(obj, 0);
+    return;
+  }
+  assert(rm->kind == OP_MEM);
+  // %rbp and %r13 as base without displacement would mean RIP-relative,
+  // and %rsp and %r12 as base need a SIB byte, as does an index, where
+  // %rsp in the index field means none.
+  long disp = rm->val;
+  int mod = 2;
+  if (disp == 0 && (base & 7) != RBP) {
+    mod = 0;
+  } else if (is_int8(disp)) {
+    mod = 1;
+  }
+  if (sib) {
+    static int scale_bits[] = {[1] = 0, [2] = 1, [4] = 2, [8] = 3};
+    byte(obj, mod << 6 | r << 3 | 4);
+    byte(obj, scale_bits[rm->scale ? rm->scale : 1] << 6 | (index & 7) << 3 |
+                  (base & 7));
+  } else {
+    byte(obj, mod << 6 | r << 3 | (base & 7));
+  }
+  if (mod == 1) {
+    byte(obj, disp);
+  } else if (mod == 2) {
+    imm32(obj, disp);
+  }
+}
+
+// Encodes add, sub or cmp. Each takes an opcode extension for the
+// immediate forms and has an opcode for each direction of the ModRM
+// form.
+static void encode_alu(Object *obj, int ext, int op_mr, int op_rm,
+                       Operand *src, Operand *dst) {
+  if (src->kind == OP_IMM) {
+    if (is_int8(src->val)) {
+      encode_rm(obj, 0x83, true, NULL, ext, dst, 1);
+      byte(obj, src->val);
+      return;
+    }
+    if (!is_int32(src->val)) {
+      error("immediate out of range: %ld", src->val);
+    }
+    encode_rm(obj, 0x81, true, NULL, ext, dst, 4);
+    imm32(obj, src->val);
+    return;
+  }
+  if (src->kind == OP_REG) {
+    encode_rm(obj, op_mr, true, src, 0, dst, 0);
+    return;
+  }
+  encode_rm(obj, op_rm, true, dst, 0, src, 0);
+}
+
+// Encodes a jmp, jcc or call to a local label or a global symbol.
+static void encode_branch(Object *obj, int opcode, Operand *target) {
+  if (opcode > 0xff) {
+    byte(obj, opcode >> 8);
+  }
+  byte(obj, opcode);
+  int offset = section(obj)->len;
+  if (target->kind == OP_GLOBAL) {
+    add_reloc(obj, obj->cur, offset, target->name, R_X86_64_PLT32, -4);
+  } else {
+    obj->fixups =
+        grow(obj->fixups, &obj->fixups_cap, obj->nfixups + 1, sizeof(Fixup));
+    obj->fixups[obj->nfixups++] = (Fixup){offset, label_name(target)};
+  }
+  imm32(obj, 0);
+}
+
+static void encode_label(Object *obj, Operand *op) {
+  if (op->kind == OP_GLOBAL) {
+    define_symbol(obj, op->name, obj->cur, section(obj)->len);
+    return;
+  }
+  char *name = label_name(op);
+  if (hashmap_get(&obj->labels, name, strlen(name))) {
+    error("label defined twice: %s", name);
+  }
+  hashmap_put(&obj->labels, name, strlen(name),
+              (void *)(long)(section(obj)->len + 1));
+}
+
+void obj_insn(Object *obj, Mnemonic op, Operand *src, Operand *dst) {
+  switch (op) {
+  case I_LABEL:
+    encode_label(obj, dst);
+    return;
+  case I_MOV:
+    if (src->kind == OP_IMM) {
+      if (is_int32(src->val)) {
+        encode_rm(obj, 0xc7, true, NULL, 0, dst, 4);
+        imm32(obj, src->val);
+      } else {
+        // movabs
+        assert(dst->kind == OP_REG);
+        byte(obj, 0x48 | (dst->reg >= 8 ? 1 : 0));
+        byte(obj, 0xb8 | (dst->reg & 7));
+        imm64(obj, src->val);
+      }
+    } else if (src->kind == OP_REG) {
+      encode_rm(obj, src->size == 1 ? 0x88 : 0x89, src->size == 8, src, 0,
+                dst, 0);
+    } else {
+      encode_rm(obj, 0x8b, true, dst, 0, src, 0);
+    }
+    return;
+  case I_MOVSBQ:
+    encode_rm(obj, 0x0fbe, true, dst, 0, src, 0);
+    return;
+  case I_MOVZB:
+    encode_rm(obj, 0x0fb6, true, dst, 0, src, 0);
+    return;
+  case I_LEA:
+    encode_rm(obj, 0x8d, true, dst, 0, src, 0);
+    return;
+  case I_PUSH:
+  case I_POP:
+    if (dst->reg >= 8) {
+      byte(obj, 0x41);
+    }
+    byte(obj, (op == I_PUSH ? 0x50 : 0x58) | (dst->reg & 7));
+    return;
+  case I_XCHG:
+    encode_rm(obj, 0x87, true, dst, 0, src, 0);
+    return;
+  case I_ADD:
+    encode_alu(obj, 0, 0x01, 0x03, src, dst);
+    return;
+  case I_SUB:
+    encode_alu(obj, 5, 0x29, 0x2b, src, dst);
+    return;
+  case I_CMP:
+    encode_alu(obj, 7, 0x39, 0x3b, src, dst);
+    return;
+  case I_IMUL:
+    if (src->kind == OP_NONE) {
+      encode_rm(obj, 0xf7, true, NULL, 5, dst, 0);
+      return;
+    }
+    if (src->kind == OP_IMM) {
+      if (is_int8(src->val)) {
+        encode_rm(obj, 0x6b, true, dst, 0, dst, 1);
+        byte(obj, src->val);
+      } else {
+        encode_rm(obj, 0x69, true, dst, 0, dst, 4);
+        imm32(obj, src->val);
+      }
+      return;
+    }
+    encode_rm(obj, 0x0faf, true, dst, 0, src, 0);
+    return;
+  case I_IDIV:
+    encode_rm(obj, 0xf7, true, NULL, 7, dst, 0);
+    return;
+  case I_SHL:
+  case I_SHR:
+  case I_SAR:
+    encode_rm(obj, 0xc1, true, NULL, op == I_SHL ? 4 : op == I_SHR ? 5 : 7,
+              dst, 1);
+    byte(obj, src->val);
+    return;
+  case I_CQO:
+    byte(obj, 0x48);
+    byte(obj, 0x99);
+    return;
+  case I_NEG:
+    encode_rm(obj, 0xf7, true, NULL, 3, dst, 0);
+    return;
+  case I_SETE:
+    encode_rm(obj, 0x0f94, false, NULL, 0, dst, 0);
+    return;
+  case I_SETNE:
+    encode_rm(obj, 0x0f95, false, NULL, 0, dst, 0);
+    return;
+  case I_SETL:
+    encode_rm(obj, 0x0f9c, false, NULL, 0, dst, 0);
+    return;
+  case I_SETLE:
+    encode_rm(obj, 0x0f9e, false, NULL, 0, dst, 0);
+    return;
+  case I_JMP:
+    encode_branch(obj, 0xe9, dst);
+    return;
+  case I_JE:
+    encode_branch(obj, 0x0f84, dst);
+    return;
+  case I_JNE:
+    encode_branch(obj, 0x0f85, dst);
+    return;
+  case I_JGE:
+    encode_branch(obj, 0x0f8d, dst);
+    return;
+  case I_JG:
+    encode_branch(obj, 0x0f8f, dst);
+    return;
+  case I_CALL:
+    encode_branch(obj, 0xe8, dst);
+    return;
+  case I_RET:
+    byte(obj, 0xc3);
+    return;
+  }
+  error("cannot encode instruction %d", op);
+}
+
+// Switches to a section given as in a .section directive, i.e. its name
+// optionally followed by flags.
+static void switch_section(Object *obj, char *arg) {
+  int len = strcspn(arg, ",");
+  for (int i = 0; i < NSECS; i++) {
+    if (strlen(sec_info[i].name) == len &&
+        !strncmp(sec_info[i].name, arg, len)) {
+      obj->cur = i;
+      return;
+    }
+  }
+  error("unsupported section in object output: %s", arg);
+}
+
+void obj_directive(Object *obj, char *dir, char *arg, long val) {
+  if (!strcmp(dir, ".text")) {
+    obj->cur = SEC_TEXT;
+  } else if (!strcmp(dir, ".data")) {
+    obj->cur = SEC_DATA;
+  } else if (!strcmp(dir, ".bss")) {
+    obj->cur = SEC_BSS;
+  } else if (!strcmp(dir, ".section")) {
+    switch_section(obj, arg);
+  } else if (!strcmp(dir, ".globl") || !strcmp(dir, ".global")) {
+    get_symbol(obj, arg)->global = true;
+  } else if (!strcmp(dir, ".byte")) {
+    byte(obj, val);
+  } else if (!strcmp(dir, ".ascii")) {
+    ascii(obj, arg);
+  } else if (!strcmp(dir, ".zero")) {
+    zero(obj, val);
+  } else if (!strcmp(dir, ".align")) {
+    zero(obj, (val - section(obj)->len % val) % val);
+  } else {
+    error("unsupported directive in object output: %s", dir);
+  }
+}
+
+//
+// Linking objects together
+//
+
+static void resolve_fixups(Object *obj) {
+  Buf *b = &obj->secs[SEC_TEXT];
+  for (int i = 0; i < obj->nfixups; i++) {
+    Fixup *fx = &obj->fixups[i];
+    long dest = (long)hashmap_get(&obj->labels, fx->label, strlen(fx->label));
+    if (!dest) {
+      error("undefined label: %s", fx->label);
+    }
+    int32_t rel = dest - 1 - (fx->offset + 4);
+    memcpy(b->buf + fx->offset, &rel, 4);
+    free(fx->label);
+  }
+  obj->nfixups = 0;
+}
+
+static void obj_free(Object *obj) {
+  for (int i = 0; i < NSECS; i++) {
+    free(obj->secs[i].buf);
+  }
+  for (int i = 0; i < obj->labels.capacity; i++) {
+    free(obj->labels.buckets[i].key);
+  }
+  hashmap_free(&obj->labels);
+  for (int i = 0; i < obj->nsyms; i++) {
+    free(obj->syms[i]);
+  }
+  hashmap_free(&obj->symmap);
+  free(obj->syms);
+  free(obj->relocs);
+  free(obj->fixups);
+  free(obj);
+}
+
+// Appends the sections of src to those of dst and frees src.
+void obj_append(Object *dst, Object *src) {
+  resolve_fixups(src);
+  int base[NSECS];
+  for (int i = 0; i < NSECS; i++) {
+    base[i] = dst->secs[i].len;
+    if (sec_info[i].type == SHT_NOBITS) {
+      dst->secs[i].len += src->secs[i].len;
+    } else {
+      buf_append(&dst->secs[i], src->secs[i].buf, src->secs[i].len);
+    }
+  }
+  for (int i = 0; i < src->nrelocs; i++) {
+    Reloc *rel = &src->relocs[i];
+    add_reloc(dst, rel->sec, base[rel->sec] + rel->offset, rel->sym,
+              rel->type, rel->addend);
+  }
+  for (int i = 0; i < src->nsyms; i++) {
+    Symbol *sym = src->syms[i];
+    if (sym->sec != -1) {
+      define_symbol(dst, sym->name, sym->sec, base[sym->sec] + sym->offset);
+    }
+    if (sym->global) {
+      get_symbol(dst, sym->name)->global = true;
+    }
+  }
+  obj_free(src);
+}
+
+//
+// ELF writer
+//
+
+static int add_string(Buf *strtab, char *s) {
+  int off = strtab->len;
+  buf_append(strtab, s, strlen(s) + 1);
+  return off;
+}
+
+static void align_buf(Buf *b, int align) {
+  buf_zero(b, (align - b->len % align) % align);
+}
+
+// Serializes obj into an ELF relocatable file, frees it and returns the
+// file contents.
+char *obj_finish(Object *obj, int *len) {
+  resolve_fixups(obj);
+
+  // Section header table layout: null, the sections, .symtab, .strtab,
+  // .shstrtab, .note.GNU-stack, then the relocation sections of the
+  // sections that have relocations. The linker doesn't merge strings in
+  // a section with a relocation section, even an empty one.
+  enum { SH_SECS = 1, SH_SYMTAB = SH_SECS + NSECS, SH_STRTAB, SH_SHSTRTAB,
+         SH_NOTE, SH_RELA };
+  Elf64_Shdr sh[SH_RELA + NSECS] = {};
+  int shnum = SH_RELA;
+  Buf shstrtab = {};
+  Buf strtab = {};
+  buf_zero(&shstrtab, 1);
+  buf_zero(&strtab, 1);
+
+  // Local symbols must precede global ones.
+  Buf symtab = {};
+  buf_zero(&symtab, sizeof(Elf64_Sym));
+  int nsyms = 1;
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      sh[SH_SYMTAB].sh_info = nsyms;
+    }
+    for (int i = 0; i < obj->nsyms; i++) {
+      Symbol *sym = obj->syms[i];
+      // Undefined symbols are references to other files.
+      bool global = sym->global || sym->sec == -1;
+      if (global != pass) {
+        continue;
+      }
+      Elf64_Sym esym = {
+          .st_name = add_string(&strtab, sym->name),
+          .st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL,
+                                   sym->sec == SEC_TEXT ? STT_FUNC
+                                   : sym->sec == -1     ? STT_NOTYPE
+                                                        : STT_OBJECT),
+          .st_shndx = sym->sec == -1 ? SHN_UNDEF : SH_SECS + sym->sec,
+          .st_value = sym->sec == -1 ? 0 : sym->offset,
+      };
+      buf_append(&symtab, &esym, sizeof(esym));
+      sym->index = nsyms++;
+    }
+  }
+
+  Buf rela[NSECS] = {};
+  for (int i = 0; i < obj->nrelocs; i++) {
+    Reloc *rel = &obj->relocs[i];
+    Symbol *sym = get_symbol(obj, rel->sym);
+    Elf64_Rela erel = {
+        .r_offset = rel->offset,
+        .r_info = ELF64_R_INFO(sym->index, rel->type),
+        .r_addend = rel->addend,
+    };
+    buf_append(&rela[rel->sec], &erel, sizeof(erel));
+  }
+
+  // Lay out the file: ELF header, section contents, section headers.
+  Buf out = {};
+  buf_zero(&out, sizeof(Elf64_Ehdr));
+  for (int i = 0; i < NSECS; i++) {
+    align_buf(&out, 16);
+    sh[SH_SECS + i] = (Elf64_Shdr){
+        .sh_name = add_string(&shstrtab, sec_info[i].name),
+        .sh_type = sec_info[i].type,
+        .sh_flags = sec_info[i].flags,
+        .sh_offset = out.len,
+        .sh_size = obj->secs[i].len,
+        .sh_addralign = sec_info[i].align,
+        .sh_entsize = sec_info[i].entsize,
+    };
+    if (sec_info[i].type != SHT_NOBITS) {
+      buf_append(&out, obj->secs[i].buf, obj->secs[i].len);
+    }
+  }
+  for (int i = 0; i < NSECS; i++) {
+    if (!rela[i].len) {
+      continue;
+    }
+    align_buf(&out, 8);
+    char name[32];
+    snprintf(name, sizeof(name), ".rela%s", sec_info[i].name);
+    sh[shnum++] = (Elf64_Shdr){
+        .sh_name = add_string(&shstrtab, name),
+        .sh_type = SHT_RELA,
+        .sh_flags = SHF_INFO_LINK,
+        .sh_offset = out.len,
+        .sh_size = rela[i].len,
+        .sh_link = SH_SYMTAB,
+        .sh_info = SH_SECS + i,
+        .sh_addralign = 8,
+        .sh_entsize = sizeof(Elf64_Rela),
+    };
+    buf_append(&out, rela[i].buf, rela[i].len);
+    free(rela[i].buf);
+  }
+
+  align_buf(&out, 8);
+  sh[SH_SYMTAB].sh_name = add_string(&shstrtab, ".symtab");
+  sh[SH_SYMTAB].sh_type = SHT_SYMTAB;
+  sh[SH_SYMTAB].sh_offset = out.len;
+  sh[SH_SYMTAB].sh_size = symtab.len;
+  sh[SH_SYMTAB].sh_link = SH_STRTAB;
+  sh[SH_SYMTAB].sh_addralign = 8;
+  sh[SH_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+  buf_append(&out, symtab.buf, symtab.len);
+
+  sh[SH_STRTAB].sh_name = add_string(&shstrtab, ".strtab");
+  sh[SH_STRTAB].sh_type = SHT_STRTAB;
+  sh[SH_STRTAB].sh_offset = out.len;
+  sh[SH_STRTAB].sh_size = strtab.len;
+  sh[SH_STRTAB].sh_addralign = 1;
+  buf_append(&out, strtab.buf, strtab.len);
+
+  // Marks the stack as non-executable.
+  sh[SH_NOTE].sh_name = add_string(&shstrtab, ".note.GNU-stack");
+  sh[SH_NOTE].sh_type = SHT_PROGBITS;
+  sh[SH_NOTE].sh_offset = out.len;
+  sh[SH_NOTE].sh_addralign = 1;
+
+  sh[SH_SHSTRTAB].sh_name = add_string(&shstrtab, ".shstrtab");
+  sh[SH_SHSTRTAB].sh_type = SHT_STRTAB;
+  sh[SH_SHSTRTAB].sh_offset = out.len;
+  sh[SH_SHSTRTAB].sh_size = shstrtab.len;
+  sh[SH_SHSTRTAB].sh_addralign = 1;
+  buf_append(&out, shstrtab.buf, shstrtab.len);
+
+  align_buf(&out, 8);
+  Elf64_Ehdr eh = {
+      .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB,
+                  EV_CURRENT, ELFOSABI_NONE},
+      .e_type = ET_REL,
+      .e_machine = EM_X86_64,
+      .e_version = EV_CURRENT,
+      .e_shoff = out.len,
+      .e_ehsize = sizeof(Elf64_Ehdr),
+      .e_shentsize = sizeof(Elf64_Shdr),
+      .e_shnum = shnum,
+      .e_shstrndx = SH_SHSTRTAB,
+  };
+  buf_append(&out, sh, shnum * sizeof(Elf64_Shdr));
+  memcpy(out.buf, &eh, sizeof(eh));
+
+  free(symtab.buf);
+  free(strtab.buf);
+  free(shstrtab.buf);
+  obj_free(obj);
+  *len = out.len;
+  return out.buf;
+}
@@ -0,0 +1,450 @@
+#include "ycc.h"
+#include <errno.h>
+#include <unistd.h>
+
+// Assembly output is appended to a large buffer by routines specialized
+// for each kind of token (mnemonic, register, immediate, label), so no
+// format string is interpreted per instruction. Each thread appends to
+// its own current Output: either the one backed by the output file
+// descriptor, which is written out whenever it fills up, or an in-memory
+// buffer that grows as needed and is copied into the file output later.
+// Unless -fno-peephole is given, instructions are held back in a list
+// for the peephole optimizer until a directive or the end of the output.
+//
+// An in-memory output can also record what is written to it, in a
+// compact binary form that emit_replay() writes out again, as text or
+// machine code alike. The function cache stores such recordings.
+
+struct Output {
+  int fd; // -1 for in-memory output
+  char *buf;
+  int len;
+  int cap;
+  char *scope; // Function name that qualifies local labels
+  Object *obj; // Machine code instead of text, with -c
+  Insn *insns; // Instructions not written yet
+  int ninsns;
+  int insns_cap;
+  long count; // Instructions written, excluding labels
+  bool recording;
+  char *rec; // Recording of what was written
+  int rec_len;
+  int rec_cap;
+};
+
+// Tags of the entries of a recording
+enum { REC_INSN, REC_DIRECTIVE, REC_DIRECTIVE_NUM };
+
+static char fdbuf[1 << 16];
+static Output fd_output = {.fd = 1, .buf = fdbuf, .cap = sizeof(fdbuf)};
+static _Thread_local Output *cur = &fd_output;
+
+static char *reg64[] = {"%rax", "%rcx", "%rdx", "%rbx", "%rsp", "%rbp",
+                        "%rsi", "%rdi", "%r8",  "%r9",  "%r10", "%r11",
+                        "%r12", "%r13", "%r14", "%r15"};
+static char *reg8[] = {"%al",  "%cl",  "%dl",   "%bl",   "%spl",  "%bpl",
+                       "%sil", "%dil", "%r8b",  "%r9b",  "%r10b", "%r11b",
+                       "%r12b", "%r13b", "%r14b", "%r15b"};
+
+// Each mnemonic is stored together with its indentation and the space
+// that separates it from the operands.
+static char *mnemonics[] = {
+    [I_MOV] = "    mov ", [I_MOVSBQ] = "    movsbq ", [I_MOVZB] = "    movzb ",
+    [I_LEA] = "    lea ", [I_PUSH] = "    push ", [I_POP] = "    pop ",
+    [I_XCHG] = "    xchg ", [I_ADD] = "    add ", [I_SUB] = "    sub ",
+    [I_IMUL] = "    imul ", [I_IDIV] = "    idivq ", [I_SHL] = "    shl ",
+    [I_SHR] = "    shr ", [I_SAR] = "    sar ", [I_CQO] = "    cqo",
+    [I_NEG] = "    neg ", [I_CMP] = "    cmp ", [I_SETE] = "    sete ",
+    [I_SETNE] = "    setne ", [I_SETL] = "    setl ", [I_SETLE] = "    setle ",
+    [I_JMP] = "    jmp ", [I_JE] = "    je ", [I_JNE] = "    jne ",
+    [I_JGE] = "    jge ", [I_JG] = "    jg ", [I_CALL] = "    call ",
+    [I_RET] = "    ret",
+};
+
+void emit_open(int fd, bool object) {
+  fd_output.fd = fd;
+  if (object) {
+    fd_output.obj = obj_new();
+  }
+}
+
+static void write_all(int fd, char *p, int len) {
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error("cannot write output: %s", strerror(errno));
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+static void flush_fd(void) {
+  write_all(fd_output.fd, fd_output.buf, fd_output.len);
+  fd_output.len = 0;
+}
+
+static void out(char *s, int len) {
+  if (cur->len + len > cur->cap) {
+    if (cur->fd >= 0) {
+      flush_fd();
+      if (len > cur->cap) {
+        write_all(cur->fd, s, len);
+        return;
+      }
+    } else {
+      while (cur->len + len > cur->cap) {
+        cur->cap = cur->cap ? cur->cap * 2 : 4096;
+      }
+      cur->buf = realloc(cur->buf, cur->cap);
+      if (!cur->buf) {
+        error("out of memory");
+      }
+    }
+  }
+  memcpy(cur->buf + cur->len, s, len);
+  cur->len += len;
+}
+
+static void flush_insns(void);
+
+void emit_flush(void) {
+  emit_to(NULL);
+  flush_insns();
+  if (fd_output.obj) {
+    int len;
+    char *buf = obj_finish(fd_output.obj, &len);
+    fd_output.obj = NULL;
+    write_all(fd_output.fd, buf, len);
+    free(buf);
+    return;
+  }
+  flush_fd();
+}
+
+Output *output_new(char *scope) {
+  Output *o = calloc(1, sizeof(Output));
+  o->fd = -1;
+  o->scope = scope;
+  if (fd_output.obj) {
+    o->obj = obj_new();
+  }
+  return o;
+}
+
+// Makes o the current output of this thread. NULL selects the output
+// file.
+void emit_to(Output *o) {
+  flush_insns();
+  cur = o ? o : &fd_output;
+}
+
+// Appends the contents of an in-memory output and frees it.
+void emit_output(Output *o) {
+  if (o->obj) {
+    obj_append(fd_output.obj, o->obj);
+  }
+  out(o->buf, o->len);
+  fd_output.count += o->count;
+  free(o->rec);
+  free(o->buf);
+  free(o->insns);
+  free(o);
+}
+
+static void out_str(char *s) { out(s, strlen(s)); }
+
+static void out_char(char c) {
+  if (cur->len == cur->cap) {
+    out(&c, 1);
+    return;
+  }
+  cur->buf[cur->len++] = c;
+}
+
+static void out_num(long val) {
+  char buf[24];
+  char *p = buf + sizeof(buf);
+  unsigned long u = val < 0 ? -(unsigned long)val : val;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (val < 0) {
+    *--p = '-';
+  }
+  out(p, buf + sizeof(buf) - p);
+}
+
+static void out_operand(Operand *op) {
+  switch (op->kind) {
+  case OP_REG:
+    out_str(op->size == 1 ? reg8[op->reg] : reg64[op->reg]);
+    return;
+  case OP_IMM:
+    out_char('$');
+    out_num(op->val);
+    return;
+  case OP_MEM:
+    if (op->val) {
+      out_num(op->val);
+    }
+    out_char('(');
+    out_str(reg64[op->reg]);
+    if (op->scale) {
+      out_char(',');
+      out_str(reg64[op->index]);
+      out_char(',');
+      out_char('0' + op->scale);
+    }
+    out_char(')');
+    return;
+  case OP_SYM:
+    out_str(op->name);
+    out_str("(%rip)");
+    return;
+  case OP_LABEL:
+    out_str(op->name);
+    if (cur->scope) {
+      out_str(cur->scope);
+    }
+    if (op->val >= 0) {
+      out_char('.');
+      out_num(op->val);
+    }
+    return;
+  case OP_GLOBAL:
+    out_str(op->name);
+    return;
+  }
+}
+
+static void rec_bytes(void *p, int len) {
+  if (cur->rec_len + len > cur->rec_cap) {
+    while (cur->rec_len + len > cur->rec_cap) {
+      cur->rec_cap = cur->rec_cap ? cur->rec_cap * 2 : 4096;
+    }
+    cur->rec = realloc(cur->rec, cur->rec_cap);
+    if (!cur->rec) {
+      error("out of memory");
+    }
+  }
+  memcpy(cur->rec + cur->rec_len, p, len);
+  cur->rec_len += len;
+}
+
+static void rec_byte(int c) {
+  char b = c;
+  rec_bytes(&b, 1);
+}
+
+static void rec_long(long val) { rec_bytes(&val, sizeof(val)); }
+
+// Strings are recorded with their terminator, so that the replay can
+// use them in place. NULL is recorded as a single 0xff byte.
+static void rec_str(char *s) {
+  if (s) {
+    rec_bytes(s, strlen(s) + 1);
+  } else {
+    rec_byte(0xff);
+  }
+}
+
+static void rec_operand(Operand *op) {
+  rec_byte(op->kind);
+  if (op->kind == OP_NONE) {
+    return;
+  }
+  rec_byte(op->size);
+  rec_byte(op->reg);
+  rec_byte(op->index);
+  rec_byte(op->scale);
+  rec_long(op->val);
+  rec_str(op->name);
+}
+
+static void write_insn(Insn *insn) {
+  if (cur->recording) {
+    rec_byte(REC_INSN);
+    rec_byte(insn->op);
+    rec_operand(&insn->src);
+    rec_operand(&insn->dst);
+  }
+  if (insn->op != I_LABEL) {
+    cur->count++;
+  }
+  if (cur->obj) {
+    obj_insn(cur->obj, insn->op, &insn->src, &insn->dst);
+    return;
+  }
+  if (insn->op == I_LABEL) {
+    out_operand(&insn->dst);
+    out(":\n", 2);
+    return;
+  }
+  out_str(mnemonics[insn->op]);
+  if (insn->src.kind != OP_NONE) {
+    out_operand(&insn->src);
+    out_char(',');
+  }
+  out_operand(&insn->dst);
+  out_char('\n');
+}
+
+static void flush_insns(void) {
+  for (int i = 0; i < cur->ninsns; i++) {
+    write_insn(&cur->insns[i]);
+  }
+  cur->ninsns = 0;
+}
+
+void emit_insn(Mnemonic op, Operand src, Operand dst) {
+  Insn insn = {op, src, dst};
+  if (!opt_fpeephole) {
+    write_insn(&insn);
+    return;
+  }
+  if (cur->ninsns == cur->insns_cap) {
+    cur->insns_cap = cur->insns_cap ? cur->insns_cap * 2 : 256;
+    cur->insns = realloc(cur->insns, cur->insns_cap * sizeof(Insn));
+    if (!cur->insns) {
+      error("out of memory");
+    }
+  }
+  cur->insns[cur->ninsns++] = insn;
+  cur->ninsns = peephole(cur->insns, cur->ninsns);
+}
+
+// Returns the number of instructions written to the output file so far.
+long emit_insn_count(void) { return fd_output.count; }
+
+// Emits an assembler directive with an optional argument.
+void emit_directive(char *dir, char *arg) {
+  flush_insns();
+  if (cur->recording) {
+    rec_byte(REC_DIRECTIVE);
+    rec_str(dir);
+    rec_str(arg);
+  }
+  if (cur->obj) {
+    obj_directive(cur->obj, dir, arg, 0);
+    return;
+  }
+  out("    ", 4);
+  out_str(dir);
+  if (arg) {
+    out_char(' ');
+    out_str(arg);
+  }
+  out_char('\n');
+}
+
+void emit_directive_num(char *dir, long val) {
+  flush_insns();
+  if (cur->recording) {
+    rec_byte(REC_DIRECTIVE_NUM);
+    rec_str(dir);
+    rec_long(val);
+  }
+  if (cur->obj) {
+    obj_directive(cur->obj, dir, NULL, val);
+    return;
+  }
+  out("    ", 4);
+  out_str(dir);
+  out_char(' ');
+  out_num(val);
+  out_char('\n');
+}
+
+// Starts recording what is written to an in-memory output.
+void output_record(Output *o) { o->recording = true; }
+
+// Returns the recording of an output. It stays valid until the output
+// is freed.
+char *output_recording(Output *o, int *len) {
+  *len = o->rec_len;
+  return o->rec;
+}
+
+typedef struct {
+  char *p;
+  char *end;
+} Reader;
+
+static int read_byte(Reader *r) {
+  if (r->p == r->end) {
+    error("corrupt recording");
+  }
+  return (unsigned char)*r->p++;
+}
+
+static long read_long(Reader *r) {
+  long val;
+  if (r->end - r->p < sizeof(val)) {
+    error("corrupt recording");
+  }
+  memcpy(&val, r->p, sizeof(val));
+  r->p += sizeof(val);
+  return val;
+}
+
+static char *read_str(Reader *r) {
+  if (r->p < r->end && (unsigned char)*r->p == 0xff) {
+    r->p++;
+    return NULL;
+  }
+  char *s = r->p;
+  char *nul = memchr(s, '\0', r->end - s);
+  if (!nul) {
+    error("corrupt recording");
+  }
+  r->p = nul + 1;
+  return s;
+}
+
+static void read_operand(Reader *r, Operand *op) {
+  *op = (Operand){read_byte(r)};
+  if (op->kind == OP_NONE) {
+    return;
+  }
+  op->size = read_byte(r);
+  op->reg = read_byte(r);
+  op->index = read_byte(r);
+  op->scale = read_byte(r);
+  op->val = read_long(r);
+  op->name = read_str(r);
+}
+
+// Writes out a recording to the current output, bypassing the peephole
+// optimizer, which already ran. Strings are used in place, so buf must
+// outlive the output.
+void emit_replay(char *buf, int len) {
+  Reader r = {buf, buf + len};
+  while (r.p < r.end) {
+    switch (read_byte(&r)) {
+    case REC_INSN: {
+      Insn insn = {read_byte(&r)};
+      read_operand(&r, &insn.src);
+      read_operand(&r, &insn.dst);
+      write_insn(&insn);
+      break;
+    }
+    case REC_DIRECTIVE: {
+      char *dir = read_str(&r);
+      emit_directive(dir, read_str(&r));
+      break;
+    }
+    case REC_DIRECTIVE_NUM: {
+      char *dir = read_str(&r);
+      emit_directive_num(dir, read_long(&r));
+      break;
+    }
+    default:
+      error("corrupt recording");
+    }
+  }
+}
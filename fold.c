@@ -0,0 +1,213 @@
+#include "ycc.h"
+#include <limits.h>
+
+static Node *fold_expr(Node *node);
+
+static bool has_side_effect(Node *node) {
+  if (!node) {
+    return false;
+  }
+  switch (node->kind) {
+  case ND_ASSIGN:
+  case ND_FUNCALL:
+    return true;
+  case ND_STMT_EXPR:
+    // Only expression statements and empty blocks are looked into.
+    for (Node *stmt = node->body; stmt; stmt = stmt->next) {
+      if (stmt->kind == ND_BLOCK && !stmt->body) {
+        continue;
+      }
+      if (stmt->kind != ND_EXPR_STMT || has_side_effect(stmt->lhs)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  return has_side_effect(node->lhs) || has_side_effect(node->rhs);
+}
+
+// Reports whether two side-effect free expressions compute the same value.
+static bool same_expr(Node *a, Node *b) {
+  if (!a || !b) {
+    return a == b;
+  }
+  if (a->kind != b->kind) {
+    return false;
+  }
+  switch (a->kind) {
+  case ND_NUM:
+    return a->val == b->val;
+  case ND_VAR:
+    return a->var == b->var;
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_NEG:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_ADDR:
+  case ND_DEREF:
+    return same_expr(a->lhs, b->lhs) && same_expr(a->rhs, b->rhs);
+  }
+  return false;
+}
+
+static bool is_num(Node *node, long val) {
+  return node->kind == ND_NUM && node->val == val;
+}
+
+static Node *to_num(Node *node, long val) {
+  node->kind = ND_NUM;
+  node->val = val;
+  node->lhs = node->rhs = NULL;
+  node->ty = ty_int;
+  return node;
+}
+
+// Evaluates a binary operator over two constants. Returns false if the
+// result is left for run time, e.g. on division by zero.
+static bool eval_binary(NodeKind kind, long l, long r, long *val) {
+  unsigned long ul = l, ur = r;
+  switch (kind) {
+  case ND_ADD:
+    *val = ul + ur;
+    return true;
+  case ND_SUB:
+    *val = ul - ur;
+    return true;
+  case ND_MUL:
+    *val = ul * ur;
+    return true;
+  case ND_DIV:
+    if (r == 0 || (l == LONG_MIN && r == -1)) {
+      return false;
+    }
+    *val = l / r;
+    return true;
+  case ND_EQ:
+    *val = l == r;
+    return true;
+  case ND_NE:
+    *val = l != r;
+    return true;
+  case ND_LT:
+    *val = l < r;
+    return true;
+  case ND_LE:
+    *val = l <= r;
+    return true;
+  }
+  return false;
+}
+
+static Node *fold_list(Node *head) {
+  Node dummy = {.next = head};
+  for (Node *prev = &dummy; prev->next; prev = prev->next) {
+    Node *next = prev->next->next;
+    prev->next = fold_expr(prev->next);
+    prev->next->next = next;
+  }
+  return dummy.next;
+}
+
+// Folds the subtree and returns the node to replace it with.
+static Node *fold_expr(Node *node) {
+  if (!node) {
+    return NULL;
+  }
+
+  node->lhs = fold_expr(node->lhs);
+  node->rhs = fold_expr(node->rhs);
+  node->cond = fold_expr(node->cond);
+  node->then = fold_expr(node->then);
+  node->els = fold_expr(node->els);
+  node->init = fold_expr(node->init);
+  node->inc = fold_expr(node->inc);
+  node->body = fold_list(node->body);
+  node->args = fold_list(node->args);
+
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+  long val;
+
+  switch (node->kind) {
+  case ND_NEG:
+    if (lhs->kind == ND_NUM) {
+      return to_num(node, -(unsigned long)lhs->val);
+    }
+    return node;
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    if (lhs->kind == ND_NUM && rhs->kind == ND_NUM &&
+        eval_binary(node->kind, lhs->val, rhs->val, &val)) {
+      return to_num(node, val);
+    }
+    break;
+  default:
+    return node;
+  }
+
+  switch (node->kind) {
+  case ND_ADD:
+    // x+0, 0+x
+    if (is_num(rhs, 0)) {
+      return lhs;
+    }
+    if (is_num(lhs, 0)) {
+      return rhs;
+    }
+    // (x+c1)+c2 => x+(c1+c2); this also merges scaled pointer offsets.
+    if (rhs->kind == ND_NUM && lhs->kind == ND_ADD &&
+        lhs->rhs->kind == ND_NUM) {
+      lhs->rhs->val = (unsigned long)lhs->rhs->val + rhs->val;
+      return lhs;
+    }
+    return node;
+  case ND_SUB:
+    // x-0, x-x
+    if (is_num(rhs, 0)) {
+      return lhs;
+    }
+    if (!has_side_effect(lhs) && same_expr(lhs, rhs)) {
+      return to_num(node, 0);
+    }
+    return node;
+  case ND_MUL:
+    // x*1, 1*x, x*0, 0*x
+    if (is_num(rhs, 1)) {
+      return lhs;
+    }
+    if (is_num(lhs, 1)) {
+      return rhs;
+    }
+    if ((is_num(rhs, 0) && !has_side_effect(lhs)) ||
+        (is_num(lhs, 0) && !has_side_effect(rhs))) {
+      return to_num(node, 0);
+    }
+    return node;
+  case ND_DIV:
+    // x/1
+    if (is_num(rhs, 1)) {
+      return lhs;
+    }
+    return node;
+  }
+  return node;
+}
+
+void fold(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (fn->is_function) {
+      fn->body = fold_expr(fn->body);
+    }
+  }
+}
@@ -0,0 +1,87 @@
+#include "ycc.h"
+#include <stdint.h>
+
+// Open-addressing hash map with string keys and linear probing.
+
+#define INIT_SIZE 16
+#define HIGH_WATERMARK 70 // Grow once 70% of the buckets are in use
+
+static uint64_t fnv_hash(char *s, int len) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (int i = 0; i < len; i++) {
+    hash *= 0x100000001b3;
+    hash ^= (unsigned char)s[i];
+  }
+  return hash;
+}
+
+static bool match(HashEntry *ent, char *key, int keylen) {
+  return ent->key == key ||
+         (ent->keylen == keylen && !memcmp(ent->key, key, keylen));
+}
+
+static HashEntry *get_entry(HashMap *map, char *key, int keylen) {
+  if (!map->buckets) {
+    return NULL;
+  }
+  uint64_t hash = fnv_hash(key, keylen);
+  for (int i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[(hash + i) & (map->capacity - 1)];
+    if (!ent->key) {
+      return NULL;
+    }
+    if (match(ent, key, keylen)) {
+      return ent;
+    }
+  }
+  return NULL;
+}
+
+static void rehash(HashMap *map) {
+  HashMap map2 = {};
+  map2.capacity = map->capacity ? map->capacity * 2 : INIT_SIZE;
+  map2.buckets = calloc(map2.capacity, sizeof(HashEntry));
+  if (!map2.buckets) {
+    error("out of memory");
+  }
+  for (int i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[i];
+    if (ent->key) {
+      hashmap_put(&map2, ent->key, ent->keylen, ent->val);
+    }
+  }
+  free(map->buckets);
+  *map = map2;
+}
+
+void *hashmap_get(HashMap *map, char *key, int keylen) {
+  HashEntry *ent = get_entry(map, key, keylen);
+  return ent ? ent->val : NULL;
+}
+
+void hashmap_put(HashMap *map, char *key, int keylen, void *val) {
+  if ((map->used + 1) * 100 >= map->capacity * HIGH_WATERMARK) {
+    rehash(map);
+  }
+  uint64_t hash = fnv_hash(key, keylen);
+  for (int i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[(hash + i) & (map->capacity - 1)];
+    if (!ent->key) {
+      ent->key = key;
+      ent->keylen = keylen;
+      ent->val = val;
+      map->used++;
+      return;
+    }
+    if (match(ent, key, keylen)) {
+      ent->val = val;
+      return;
+    }
+  }
+  error("hashmap is full");
+}
+
+void hashmap_free(HashMap *map) {
+  free(map->buckets);
+  *map = (HashMap){};
+}
@@ -0,0 +1,275 @@
+#include "ycc.h"
+
+// Inliner. A call to a small function defined in the same file is
+// replaced by a statement expression holding a copy of the callee's body:
+//
+//   f(a, b) => ({ x = a; y = b; <body of f>; <returned expression>; })
+//
+// The parameters and locals of the callee become fresh locals of the
+// caller. Only callees whose body ends in their only return statement
+// are inlined, so that the return becomes the value of the statement
+// expression. Calls in an inlined body are inlined in turn, up to
+// INLINE_DEPTH levels, and each function grows by at most
+// INLINE_GROWTH nodes.
+
+#define INLINE_COST 40   // Maximum number of nodes in an inlined body
+#define INLINE_DEPTH 4   // Maximum nesting of inlined calls
+#define INLINE_GROWTH 2000 // Maximum number of nodes inlined per caller
+
+// Maps the locals of the callee being copied to those of the caller.
+typedef struct {
+  Obj **from;
+  Obj **to;
+  int len;
+  int cap;
+} VarMap;
+
+static HashMap functions;
+static Obj *caller;
+static int budget;
+
+// Returns the number of nodes in a statement or expression, or
+// INLINE_COST + 1 once it is known to exceed INLINE_COST.
+static int cost(Node *node, int n) {
+  for (; node && n <= INLINE_COST; node = node->next) {
+    n++;
+    n = cost(node->lhs, n);
+    n = cost(node->rhs, n);
+    n = cost(node->cond, n);
+    n = cost(node->then, n);
+    n = cost(node->els, n);
+    n = cost(node->init, n);
+    n = cost(node->inc, n);
+    n = cost(node->body, n);
+    n = cost(node->args, n);
+  }
+  return n;
+}
+
+// Counts return statements and calls of the given function.
+static int count_returns(Node *node, char *self) {
+  int n = 0;
+  for (; node; node = node->next) {
+    if (node->kind == ND_RETURN ||
+        (node->kind == ND_FUNCALL && !strcmp(node->funcname, self))) {
+      n++;
+    }
+    n += count_returns(node->lhs, self) + count_returns(node->rhs, self) +
+         count_returns(node->cond, self) + count_returns(node->then, self) +
+         count_returns(node->els, self) + count_returns(node->init, self) +
+         count_returns(node->inc, self) + count_returns(node->body, self) +
+         count_returns(node->args, self);
+  }
+  return n;
+}
+
+// Reports whether calls to fn with nargs arguments can be inlined.
+static bool is_inlinable(Obj *fn, int nargs) {
+  int nparams = 0;
+  for (Obj *var = fn->params; var; var = var->next) {
+    nparams++;
+  }
+  if (nargs != nparams || fn->body->kind != ND_BLOCK) {
+    return false;
+  }
+
+  // The last statement must be the only return, and the function must
+  // not call itself.
+  Node *last = fn->body->body;
+  while (last && last->next) {
+    last = last->next;
+  }
+  if (!last || last->kind != ND_RETURN) {
+    return false;
+  }
+  return count_returns(fn->body, fn->name) == 1 &&
+         cost(fn->body, 0) <= INLINE_COST;
+}
+
+static Obj *map_var(VarMap *map, Obj *var) {
+  if (!var || !var->is_local) {
+    return var;
+  }
+  for (int i = 0; i < map->len; i++) {
+    if (map->from[i] == var) {
+      return map->to[i];
+    }
+  }
+  return var;
+}
+
+// Returns the copies of the locals of a block, linked in the same way.
+static Obj *copy_scope(Obj *var, VarMap *map) {
+  Obj head = {};
+  Obj *cur = &head;
+  for (; var; var = var->scope_next) {
+    cur = cur->scope_next = map_var(map, var);
+  }
+  cur->scope_next = NULL;
+  return head.scope_next;
+}
+
+static Node *copy_node(Node *node, VarMap *map);
+
+static Node *copy_list(Node *node, VarMap *map) {
+  Node head = {};
+  Node *cur = &head;
+  for (; node; node = node->next) {
+    cur = cur->next = copy_node(node, map);
+  }
+  return head.next;
+}
+
+static Node *copy_node(Node *node, VarMap *map) {
+  if (!node) {
+    return NULL;
+  }
+  Node *copy = arena_alloc(&node_arena, sizeof(Node));
+  stats.nodes++;
+  *copy = *node;
+  copy->next = NULL;
+  copy->var = map_var(map, node->var);
+  copy->lhs = copy_node(node->lhs, map);
+  copy->rhs = copy_node(node->rhs, map);
+  copy->cond = copy_node(node->cond, map);
+  copy->then = copy_node(node->then, map);
+  copy->els = copy_node(node->els, map);
+  copy->init = copy_node(node->init, map);
+  copy->inc = copy_node(node->inc, map);
+  copy->body = copy_list(node->body, map);
+  copy->args = copy_list(node->args, map);
+  copy->locals = copy_scope(node->locals, map);
+  return copy;
+}
+
+static Node *new_expr_stmt(Node *expr) {
+  Node *node = arena_alloc(&node_arena, sizeof(Node));
+  stats.nodes++;
+  node->kind = ND_EXPR_STMT;
+  node->tok = expr->tok;
+  node->lhs = expr;
+  return node;
+}
+
+// Rewrites a call into a statement expression evaluating the arguments
+// into the parameters, followed by the callee's body.
+static Node *inline_call(Node *node, Obj *fn) {
+  VarMap map = {};
+  for (Obj *var = fn->locals; var; var = var->next) {
+    map.len++;
+  }
+  map.from = calloc(map.len, sizeof(Obj *));
+  map.to = calloc(map.len, sizeof(Obj *));
+  map.len = 0;
+  for (Obj *var = fn->locals; var; var = var->next) {
+    Obj *copy = arena_alloc(&sym_arena, sizeof(Obj));
+    stats.objs++;
+    *copy = *var;
+    copy->next = caller->locals;
+    caller->locals = copy;
+    map.from[map.len] = var;
+    map.to[map.len++] = copy;
+  }
+
+  Node head = {};
+  Node *cur = &head;
+  Node *arg = node->args;
+  for (Obj *param = fn->params; param; param = param->next, arg = arg->next) {
+    Node *lhs = arena_alloc(&node_arena, sizeof(Node));
+    Node *assign = arena_alloc(&node_arena, sizeof(Node));
+    stats.nodes += 2;
+    *lhs = (Node){ND_VAR, .var = map_var(&map, param), .ty = param->ty,
+                  .tok = arg->tok};
+    *assign = (Node){ND_ASSIGN, .lhs = lhs, .rhs = arg, .ty = param->ty,
+                     .tok = arg->tok};
+    cur = cur->next = new_expr_stmt(assign);
+  }
+  for (Node *stmt = fn->body->body; stmt; stmt = stmt->next) {
+    if (stmt->kind == ND_RETURN) {
+      cur = cur->next = new_expr_stmt(copy_node(stmt->lhs, &map));
+    } else {
+      cur = cur->next = copy_node(stmt, &map);
+    }
+  }
+
+  // The parameters and top-level locals of the callee only live in the
+  // statement expression.
+  Obj *scope = copy_scope(fn->body->locals, &map);
+  for (Obj *param = fn->params; param; param = param->next) {
+    Obj *var = map_var(&map, param);
+    var->scope_next = scope;
+    scope = var;
+  }
+  free(map.from);
+  free(map.to);
+
+  // A call has type int whatever the function returns.
+  Node *stmt_expr = arena_alloc(&node_arena, sizeof(Node));
+  stats.nodes++;
+  *stmt_expr = (Node){ND_STMT_EXPR, .body = head.next, .locals = scope,
+                      .ty = ty_int, .tok = node->tok};
+  return stmt_expr;
+}
+
+static Node *inline_node(Node *node, int depth);
+
+static Node *inline_list(Node *head, int depth) {
+  Node dummy = {.next = head};
+  for (Node *prev = &dummy; prev->next; prev = prev->next) {
+    Node *next = prev->next->next;
+    prev->next = inline_node(prev->next, depth);
+    prev->next->next = next;
+  }
+  return dummy.next;
+}
+
+// Inlines the calls in the subtree and returns the node to replace it
+// with.
+static Node *inline_node(Node *node, int depth) {
+  if (!node) {
+    return NULL;
+  }
+  node->lhs = inline_node(node->lhs, depth);
+  node->rhs = inline_node(node->rhs, depth);
+  node->cond = inline_node(node->cond, depth);
+  node->then = inline_node(node->then, depth);
+  node->els = inline_node(node->els, depth);
+  node->init = inline_node(node->init, depth);
+  node->inc = inline_node(node->inc, depth);
+  node->body = inline_list(node->body, depth);
+  node->args = inline_list(node->args, depth);
+
+  if (node->kind != ND_FUNCALL || depth == INLINE_DEPTH) {
+    return node;
+  }
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next) {
+    nargs++;
+  }
+  Obj *fn = hashmap_get(&functions, node->funcname, strlen(node->funcname));
+  if (!fn || !is_inlinable(fn, nargs)) {
+    return node;
+  }
+  int n = cost(fn->body, 0);
+  if (n > budget) {
+    return node;
+  }
+  budget -= n;
+  return inline_node(inline_call(node, fn), depth + 1);
+}
+
+void inline_functions(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (fn->is_function) {
+      hashmap_put(&functions, fn->name, strlen(fn->name), fn);
+    }
+  }
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (fn->is_function) {
+      caller = fn;
+      budget = INLINE_GROWTH;
+      fn->body = inline_node(fn->body, 0);
+    }
+  }
+  hashmap_free(&functions);
+}
@@ -0,0 +1,933 @@
+#include "ycc.h"
+#include <limits.h>
+#include <stdint.h>
+
+// Each function body is lowered to SSA form: a CFG of basic blocks whose
+// values are defined once, with phis where control flow merges. SSA is
+// built directly while walking the AST, as described in Braun et al.,
+// "Simple and Efficient Construction of Static Single Assignment Form".
+// Local variables become SSA values unless the function takes the
+// address of a local: pointer arithmetic from one local may reach its
+// neighbours on the stack. Any other variable is accessed through loads
+// and stores of its address.
+//
+// Sparse conditional constant propagation, dead code elimination and
+// loop-invariant code motion (see licm.c) run over the SSA form, which is
+// then scheduled for codegen. Codegen emits
+// the reachable blocks in source order. A value used once, later in the
+// same block, is computed where it is used if no memory access it could
+// be reordered with lies in between, so that expressions become trees
+// evaluated in the temporary registers. Any other value that is used is
+// computed where it is defined and kept in a stack slot of its own, its
+// home, except for constants and addresses, which are cheaper to compute
+// again. A phi is a home the predecessors store to; the CFG has no
+// critical edges, so each of them has the phi's block as its only
+// successor.
+
+// Current definition of a variable in a block.
+typedef struct {
+  Block *bb;
+  Obj *var;
+  Value *val;
+} Def;
+
+static Block **blocks;
+static int nblocks;
+static int blocks_cap;
+static Block *cur;
+
+static Def *defs;
+static int defs_cap;
+static int defs_used;
+static bool escapes; // Locals are accessed through pointers
+
+static void *grow(void *p, int *cap, int n, size_t size) {
+  if (n <= *cap) {
+    return p;
+  }
+  int cap2 = *cap ? *cap * 2 : 4;
+  while (cap2 < n) {
+    cap2 *= 2;
+  }
+  void *p2 = arena_alloc(&ir_arena, cap2 * size);
+  if (p) {
+    memcpy(p2, p, *cap * size);
+  }
+  *cap = cap2;
+  return p2;
+}
+
+static void add_arg(Value *v, Value *arg) {
+  v->args = grow(v->args, &v->args_cap, v->nargs + 1, sizeof(Value *));
+  v->args[v->nargs++] = arg;
+}
+
+//
+// Definitions
+//
+
+static uint64_t def_hash(Block *bb, Obj *var) {
+  uint64_t h = (uintptr_t)bb * 0x9e3779b97f4a7c15 ^ (uintptr_t)var;
+  return h ^ h >> 29;
+}
+
+static Def *find_def(Block *bb, Obj *var) {
+  if (!defs_cap) {
+    return NULL;
+  }
+  uint64_t h = def_hash(bb, var);
+  for (int i = 0; i < defs_cap; i++) {
+    Def *d = &defs[(h + i) & (defs_cap - 1)];
+    if (!d->var || (d->bb == bb && d->var == var)) {
+      return d;
+    }
+  }
+  return NULL;
+}
+
+static void put_def(Block *bb, Obj *var, Value *val) {
+  if ((defs_used + 1) * 10 >= defs_cap * 7) {
+    Def *old = defs;
+    int old_cap = defs_cap;
+    defs_cap = defs_cap ? defs_cap * 2 : 64;
+    defs = arena_alloc(&ir_arena, defs_cap * sizeof(Def));
+    defs_used = 0;
+    for (int i = 0; i < old_cap; i++) {
+      if (old[i].var) {
+        put_def(old[i].bb, old[i].var, old[i].val);
+      }
+    }
+  }
+  Def *d = find_def(bb, var);
+  if (!d->var) {
+    d->bb = bb;
+    d->var = var;
+    defs_used++;
+  }
+  d->val = val;
+}
+
+static Value *get_def(Block *bb, Obj *var) {
+  Def *d = find_def(bb, var);
+  return d && d->var ? d->val : NULL;
+}
+
+static bool in_ssa(Obj *var) { return var->is_local && !escapes; }
+
+// Reports whether the address of a local is taken, explicitly or by an
+// array decaying to a pointer.
+bool find_escape(Node *node) {
+  for (; node; node = node->next) {
+    if (node->kind == ND_VAR && node->var->is_local &&
+        node->var->ty->kind == TY_ARRAY) {
+      return true;
+    }
+    if (node->kind == ND_ADDR && node->lhs->kind == ND_VAR &&
+        node->lhs->var->is_local) {
+      return true;
+    }
+    if (find_escape(node->lhs) || find_escape(node->rhs) ||
+        find_escape(node->cond) || find_escape(node->then) ||
+        find_escape(node->els) || find_escape(node->init) ||
+        find_escape(node->inc) || find_escape(node->body) ||
+        find_escape(node->args)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+//
+// SSA construction
+//
+
+static Block *new_block(void) {
+  return arena_alloc(&ir_arena, sizeof(Block));
+}
+
+// Makes bb the block that code is added to. Blocks are listed in the
+// order they are entered, which is the order of the source.
+static void enter(Block *bb) {
+  bb->id = nblocks;
+  blocks = grow(blocks, &blocks_cap, nblocks + 1, sizeof(Block *));
+  blocks[nblocks++] = bb;
+  cur = bb;
+}
+
+static Value *new_value(ValueKind kind, Block *bb) {
+  Value *v = arena_alloc(&ir_arena, sizeof(Value));
+  v->kind = kind;
+  v->bb = bb;
+  v->pos = bb->nvalues;
+  bb->values = grow(bb->values, &bb->values_cap, bb->nvalues + 1,
+                    sizeof(Value *));
+  bb->values[bb->nvalues++] = v;
+  return v;
+}
+
+static Value *new_const(long val, Block *bb) {
+  Value *v = new_value(V_CONST, bb);
+  v->val = val;
+  return v;
+}
+
+static Value *new_var(ValueKind kind, Obj *var) {
+  Value *v = new_value(kind, cur);
+  v->var = var;
+  return v;
+}
+
+static Value *new_unary(ValueKind kind, Value *arg) {
+  Value *v = new_value(kind, cur);
+  add_arg(v, arg);
+  return v;
+}
+
+static Value *new_binary(NodeKind op, Value *lhs, Value *rhs) {
+  Value *v = new_value(V_BINARY, cur);
+  v->op = op;
+  add_arg(v, lhs);
+  add_arg(v, rhs);
+  return v;
+}
+
+static Value *new_load(Value *addr, Type *ty) {
+  Value *v = new_unary(V_LOAD, addr);
+  v->ty = ty;
+  return v;
+}
+
+static void add_edge(Block *from, Block *to) {
+  from->succs[from->nsuccs++] = to;
+  to->preds = grow(to->preds, &to->preds_cap, to->npreds + 1, sizeof(Edge));
+  to->preds[to->npreds++] = (Edge){from};
+}
+
+static void jump(Block *to) { add_edge(cur, to); }
+
+static void branch(Value *cond, Block *then, Block *els) {
+  cur->term = new_unary(V_BRANCH, cond);
+  add_edge(cur, then);
+  add_edge(cur, els);
+}
+
+// Phis whose operands are yet to be added. They are completed from a
+// worklist rather than recursively, since the chain of blocks between a
+// definition and its use can be arbitrarily long.
+static Value **pending;
+static int npending;
+static int pending_cap;
+
+static Value *new_phi(Obj *var, Block *bb) {
+  Value *v = new_value(V_PHI, bb);
+  v->var = var;
+  return v;
+}
+
+static Value *lookup_var(Obj *var, Block *start) {
+  Block *bb = start;
+  Value *v;
+  for (;;) {
+    v = get_def(bb, var);
+    if (v) {
+      break;
+    }
+    if (!bb->sealed) {
+      // Not all predecessors are known yet.
+      v = new_phi(var, bb);
+      bb->incomplete = grow(bb->incomplete, &bb->incomplete_cap,
+                            bb->nincomplete + 1, sizeof(Value *));
+      bb->incomplete[bb->nincomplete++] = v;
+      break;
+    }
+    if (bb->npreds == 0) {
+      // Read of an uninitialized variable, or unreachable code. Any
+      // value will do.
+      v = new_const(0, bb);
+      break;
+    }
+    if (bb->npreds > 1) {
+      v = new_phi(var, bb);
+      pending = grow(pending, &pending_cap, npending + 1, sizeof(Value *));
+      pending[npending++] = v;
+      break;
+    }
+    bb = bb->preds[0].from;
+  }
+
+  // Remember the definition in the blocks walked through.
+  for (Block *b = start;; b = b->preds[0].from) {
+    put_def(b, var, v);
+    if (b == bb) {
+      return v;
+    }
+  }
+}
+
+static void add_phi_operands(Value *phi) {
+  Block *bb = phi->bb;
+  for (int i = 0; i < bb->npreds; i++) {
+    add_arg(phi, lookup_var(phi->var, bb->preds[i].from));
+  }
+}
+
+static void complete_phis(void) {
+  while (npending) {
+    add_phi_operands(pending[--npending]);
+  }
+}
+
+static Value *read_var(Obj *var, Block *bb) {
+  Value *v = lookup_var(var, bb);
+  complete_phis();
+  return v;
+}
+
+// Marks that all predecessors of a block are known.
+static void seal(Block *bb) {
+  for (int i = 0; i < bb->nincomplete; i++) {
+    add_phi_operands(bb->incomplete[i]);
+  }
+  complete_phis();
+  bb->sealed = true;
+}
+
+static Value *lower_expr(Node *node);
+static void lower_stmt(Node *node);
+
+static Value *lower_addr(Node *node) {
+  switch (node->kind) {
+  case ND_VAR:
+    return new_var(V_ADDR, node->var);
+  case ND_DEREF:
+    return lower_expr(node->lhs);
+  }
+  error_tok(node->tok, "not an lvalue");
+}
+
+static Value *lower_expr(Node *node) {
+  switch (node->kind) {
+  case ND_NUM:
+    return new_const(node->val, cur);
+  case ND_VAR:
+    if (in_ssa(node->var)) {
+      return read_var(node->var, cur);
+    }
+    // An array evaluates to its address.
+    if (node->ty->kind == TY_ARRAY) {
+      return lower_addr(node);
+    }
+    return new_load(lower_addr(node), node->ty);
+  case ND_NEG:
+    return new_unary(V_NEG, lower_expr(node->lhs));
+  case ND_ASSIGN: {
+    if (node->lhs->kind == ND_VAR && in_ssa(node->lhs->var)) {
+      Obj *var = node->lhs->var;
+      Value *val = lower_expr(node->rhs);
+      put_def(cur, var, var->ty->kind == TY_CHAR ? new_unary(V_SEXT8, val)
+                                                 : val);
+      return val;
+    }
+    Value *addr = lower_addr(node->lhs);
+    Value *val = lower_expr(node->rhs);
+    Value *store = new_unary(V_STORE, addr);
+    add_arg(store, val);
+    store->ty = node->ty;
+    return val;
+  }
+  case ND_STMT_EXPR: {
+    // The value is that of the last expression statement.
+    Node *n = node->body;
+    for (; n && n->next; n = n->next) {
+      lower_stmt(n);
+    }
+    if (n && n->kind == ND_EXPR_STMT) {
+      return lower_expr(n->lhs);
+    }
+    if (n) {
+      lower_stmt(n);
+    }
+    return new_const(0, cur);
+  }
+  case ND_DEREF: {
+    Value *addr = lower_expr(node->lhs);
+    if (node->ty->kind == TY_ARRAY) {
+      return addr;
+    }
+    return new_load(addr, node->ty);
+  }
+  case ND_ADDR:
+    return lower_addr(node->lhs);
+  case ND_FUNCALL: {
+    // The arguments come before the call in the block.
+    Value **args = NULL;
+    int nargs = 0;
+    int cap = 0;
+    for (Node *arg = node->args; arg; arg = arg->next) {
+      args = grow(args, &cap, nargs + 1, sizeof(Value *));
+      args[nargs++] = lower_expr(arg);
+    }
+    Value *call = new_value(V_CALL, cur);
+    call->funcname = node->funcname;
+    call->args = args;
+    call->nargs = nargs;
+    call->args_cap = cap;
+    return call;
+  }
+  }
+
+  Value *lhs = lower_expr(node->lhs);
+  Value *rhs = lower_expr(node->rhs);
+  Value *v = new_binary(node->kind, lhs, rhs);
+  v->is_exact = node->is_exact;
+  return v;
+}
+
+static void lower_stmt(Node *node) {
+  switch (node->kind) {
+  case ND_RETURN:
+    cur->term = new_unary(V_RET, lower_expr(node->lhs));
+    // Whatever follows is unreachable.
+    enter(new_block());
+    seal(cur);
+    return;
+  case ND_EXPR_STMT:
+    lower_expr(node->lhs);
+    return;
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next) {
+      lower_stmt(n);
+    }
+    return;
+  case ND_IF: {
+    Value *cond = lower_expr(node->cond);
+    Block *then = new_block();
+    Block *els = new_block();
+    Block *join = new_block();
+    branch(cond, then, els);
+    seal(then);
+    seal(els);
+    enter(then);
+    lower_stmt(node->then);
+    jump(join);
+    enter(els);
+    if (node->els) {
+      lower_stmt(node->els);
+    }
+    jump(join);
+    seal(join);
+    enter(join);
+    return;
+  }
+  case ND_FOR: {
+    if (node->init) {
+      lower_stmt(node->init);
+    }
+    Block *header = new_block();
+    Block *body = new_block();
+    Block *exit = new_block();
+    jump(header);
+    enter(header);
+    if (node->cond) {
+      branch(lower_expr(node->cond), body, exit);
+    } else {
+      jump(body);
+    }
+    seal(body);
+    enter(body);
+    lower_stmt(node->then);
+    if (node->inc) {
+      lower_expr(node->inc);
+    }
+    jump(header);
+    seal(header);
+    seal(exit);
+    enter(exit);
+    return;
+  }
+  }
+}
+
+// A phi is trivial if all its operands are the same value, apart from
+// the phi itself. Such a phi is replaced by that value, which may in turn
+// make other phis trivial.
+static Value *resolve(Value *v) {
+  while (v->same) {
+    v = v->same;
+  }
+  return v;
+}
+
+static void remove_trivial_phis(void) {
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 0; i < nblocks; i++) {
+      Block *bb = blocks[i];
+      for (int j = 0; j < bb->nvalues; j++) {
+        Value *phi = bb->values[j];
+        if (phi->kind != V_PHI || phi->same) {
+          continue;
+        }
+        Value *same = NULL;
+        int k = 0;
+        for (; k < phi->nargs; k++) {
+          Value *arg = resolve(phi->args[k]);
+          if (arg == phi || arg == same) {
+            continue;
+          }
+          if (same) {
+            break;
+          }
+          same = arg;
+        }
+        if (same && k == phi->nargs) {
+          phi->same = same;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < nblocks; i++) {
+    Block *bb = blocks[i];
+    for (int j = 0; j < bb->nvalues; j++) {
+      Value *v = bb->values[j];
+      for (int k = 0; k < v->nargs; k++) {
+        v->args[k] = resolve(v->args[k]);
+      }
+    }
+  }
+}
+
+//
+// Sparse conditional constant propagation
+//
+
+static Block **block_work;
+static int nblock_work;
+static int block_work_cap;
+static Value **value_work;
+static int nvalue_work;
+static int value_work_cap;
+
+static void set_lattice(Value *v, Lattice lat, long cval) {
+  if (v->lat == lat && (lat != CONST || v->cval == cval)) {
+    return;
+  }
+  v->lat = lat;
+  v->cval = cval;
+  value_work = grow(value_work, &value_work_cap, nvalue_work + 1,
+                    sizeof(Value *));
+  value_work[nvalue_work++] = v;
+}
+
+static void eval(Value *v);
+
+static void mark_edge(Block *from, Block *to) {
+  for (int i = 0; i < to->npreds; i++) {
+    if (to->preds[i].from == from) {
+      to->preds[i].exec = true;
+    }
+  }
+  if (!to->reachable) {
+    to->reachable = true;
+    block_work =
+        grow(block_work, &block_work_cap, nblock_work + 1, sizeof(Block *));
+    block_work[nblock_work++] = to;
+    return;
+  }
+  // A new incoming edge may change the phis.
+  for (int i = 0; i < to->nvalues; i++) {
+    if (to->values[i]->kind == V_PHI) {
+      eval(to->values[i]);
+    }
+  }
+}
+
+bool is_exec(Block *from, Block *to) {
+  for (int i = 0; i < to->npreds; i++) {
+    if (to->preds[i].from == from && to->preds[i].exec) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool eval_binary(NodeKind op, long l, long r, long *val) {
+  unsigned long ul = l, ur = r;
+  switch (op) {
+  case ND_ADD:
+    *val = ul + ur;
+    return true;
+  case ND_SUB:
+    *val = ul - ur;
+    return true;
+  case ND_MUL:
+    *val = ul * ur;
+    return true;
+  case ND_DIV:
+    if (r == 0 || (l == LONG_MIN && r == -1)) {
+      return false;
+    }
+    *val = l / r;
+    return true;
+  case ND_EQ:
+    *val = l == r;
+    return true;
+  case ND_NE:
+    *val = l != r;
+    return true;
+  case ND_LT:
+    *val = l < r;
+    return true;
+  case ND_LE:
+    *val = l <= r;
+    return true;
+  }
+  return false;
+}
+
+static void eval(Value *v) {
+  switch (v->kind) {
+  case V_CONST:
+    set_lattice(v, CONST, v->val);
+    return;
+  case V_PARAM:
+  case V_ADDR:
+  case V_LOAD:
+  case V_CALL:
+    set_lattice(v, BOTTOM, 0);
+    return;
+  case V_STORE:
+  case V_RET:
+    return;
+  case V_PHI: {
+    Lattice lat = TOP;
+    long cval = 0;
+    for (int i = 0; i < v->nargs; i++) {
+      Value *arg = v->args[i];
+      if (!v->bb->preds[i].exec || arg->lat == TOP) {
+        continue;
+      }
+      if (arg->lat == BOTTOM || (lat == CONST && arg->cval != cval)) {
+        lat = BOTTOM;
+        break;
+      }
+      lat = CONST;
+      cval = arg->cval;
+    }
+    set_lattice(v, lat, cval);
+    return;
+  }
+  case V_BRANCH: {
+    Value *cond = v->args[0];
+    if (cond->lat == CONST) {
+      mark_edge(v->bb, v->bb->succs[cond->cval ? 0 : 1]);
+    } else if (cond->lat == BOTTOM) {
+      mark_edge(v->bb, v->bb->succs[0]);
+      mark_edge(v->bb, v->bb->succs[1]);
+    }
+    return;
+  }
+  }
+
+  for (int i = 0; i < v->nargs; i++) {
+    if (v->args[i]->lat == BOTTOM) {
+      set_lattice(v, BOTTOM, 0);
+      return;
+    }
+  }
+  for (int i = 0; i < v->nargs; i++) {
+    if (v->args[i]->lat == TOP) {
+      return;
+    }
+  }
+
+  long a = v->args[0]->cval;
+  long val;
+  switch (v->kind) {
+  case V_NEG:
+    set_lattice(v, CONST, -(unsigned long)a);
+    return;
+  case V_SEXT8:
+    set_lattice(v, CONST, (signed char)a);
+    return;
+  case V_BINARY:
+    if (eval_binary(v->op, a, v->args[1]->cval, &val)) {
+      set_lattice(v, CONST, val);
+    } else {
+      set_lattice(v, BOTTOM, 0);
+    }
+    return;
+  }
+}
+
+static void sccp(Block *entry) {
+  for (int i = 0; i < nblocks; i++) {
+    Block *bb = blocks[i];
+    for (int j = 0; j < bb->nvalues; j++) {
+      Value *v = bb->values[j];
+      for (int k = 0; k < v->nargs; k++) {
+        Value *arg = v->args[k];
+        arg->users =
+            grow(arg->users, &arg->users_cap, arg->nusers + 1, sizeof(Value *));
+        arg->users[arg->nusers++] = v;
+      }
+    }
+  }
+
+  nblock_work = nvalue_work = 0;
+  entry->reachable = true;
+  block_work = grow(block_work, &block_work_cap, 1, sizeof(Block *));
+  block_work[nblock_work++] = entry;
+
+  while (nblock_work || nvalue_work) {
+    if (nblock_work) {
+      Block *bb = block_work[--nblock_work];
+      for (int i = 0; i < bb->nvalues; i++) {
+        eval(bb->values[i]);
+      }
+      if (bb->nsuccs == 1) {
+        mark_edge(bb, bb->succs[0]);
+      }
+      continue;
+    }
+    Value *v = value_work[--nvalue_work];
+    for (int i = 0; i < v->nusers; i++) {
+      if (v->users[i]->bb->reachable) {
+        eval(v->users[i]);
+      }
+    }
+  }
+}
+
+//
+// Dead code elimination
+//
+
+static void mark_live(Value *v) {
+  if (v->live) {
+    return;
+  }
+  v->live = true;
+  value_work =
+      grow(value_work, &value_work_cap, nvalue_work + 1, sizeof(Value *));
+  value_work[nvalue_work++] = v;
+}
+
+// Values are live if they are needed by a store, call, return or branch
+// that is reachable. A branch on a constant becomes a jump.
+static void dce(void) {
+  nvalue_work = 0;
+  for (int i = 0; i < nblocks; i++) {
+    Block *bb = blocks[i];
+    if (!bb->reachable) {
+      continue;
+    }
+    for (int j = 0; j < bb->nvalues; j++) {
+      Value *v = bb->values[j];
+      if (v->kind == V_STORE || v->kind == V_CALL || v->kind == V_RET ||
+          (v->kind == V_BRANCH && v->args[0]->lat == BOTTOM)) {
+        mark_live(v);
+      }
+    }
+  }
+
+  // A value known to be constant is emitted as a number, so the values
+  // it is computed from aren't needed. Neither are the operands of a phi
+  // that come from edges that are never taken.
+  while (nvalue_work) {
+    Value *v = value_work[--nvalue_work];
+    if (v->lat == CONST) {
+      continue;
+    }
+    for (int i = 0; i < v->nargs; i++) {
+      if (v->kind != V_PHI || v->bb->preds[i].exec) {
+        mark_live(v->args[i]);
+      }
+    }
+  }
+}
+
+//
+// Scheduling
+//
+
+// Memory effects, which a value can't be moved across
+enum { E_READ = 1, E_WRITE = 2 };
+
+static int effect(Value *v) {
+  switch (v->kind) {
+  case V_LOAD:
+    return E_READ;
+  case V_BINARY:
+    // Division may trap.
+    return v->op == ND_DIV ? E_READ : 0;
+  case V_STORE:
+  case V_CALL:
+    return E_WRITE;
+  }
+  return 0;
+}
+
+// Reports whether a value is computed again wherever it is used.
+bool is_remat(Value *v) {
+  return v->lat == CONST || v->kind == V_CONST || v->kind == V_PARAM ||
+         v->kind == V_ADDR;
+}
+
+static void count_uses(void) {
+  for (int i = 0; i < nblocks; i++) {
+    Block *bb = blocks[i];
+    for (int j = 0; bb->reachable && j < bb->nvalues; j++) {
+      Value *v = bb->values[j];
+      if (!v->live || v->lat == CONST) {
+        continue;
+      }
+      for (int k = 0; k < v->nargs; k++) {
+        if (v->kind != V_PHI || bb->preds[k].exec) {
+          v->args[k]->nuses++;
+        }
+      }
+    }
+  }
+}
+
+// The values that read and write memory last, before the current one
+static int last_access;
+static int last_write;
+static int *effects; // Effects of each value, with those inlined into it
+static int effects_cap;
+
+// Makes a computed where it is used, later in bb, if no memory access it
+// conflicts with lies in between. eff accumulates the effects of the user.
+static void try_inline(Value *a, Block *bb, int *eff) {
+  if (a->bb != bb || a->nuses != 1 || a->kind == V_PHI || is_remat(a)) {
+    return;
+  }
+  int e = effects[a->pos];
+  if (((e & E_WRITE) && last_access > a->pos) ||
+      ((e & E_READ) && last_write > a->pos)) {
+    return;
+  }
+  a->inlined = true;
+  *eff |= e;
+}
+
+static void schedule_block(Block *bb) {
+  effects = grow(effects, &effects_cap, bb->nvalues, sizeof(int));
+  last_access = last_write = -1;
+  for (int i = 0; i < bb->nvalues; i++) {
+    Value *v = bb->values[i];
+    if (!v->live || v->lat == CONST || v->kind == V_PHI) {
+      continue;
+    }
+    int e = effect(v);
+    effects[i] = e;
+    for (int j = 0; j < v->nargs; j++) {
+      try_inline(v->args[j], bb, &effects[i]);
+    }
+    if (e) {
+      last_access = i;
+    }
+    if (e & E_WRITE) {
+      last_write = i;
+    }
+  }
+
+  // Operands of the successor's phis are stored at the end.
+  if (bb->nsuccs != 1) {
+    return;
+  }
+  Block *succ = bb->succs[0];
+  int k = 0;
+  while (succ->preds[k].from != bb) {
+    k++;
+  }
+  for (int i = 0; i < succ->nvalues; i++) {
+    Value *phi = succ->values[i];
+    if (phi->kind == V_PHI && phi->live && phi->lat != CONST) {
+      int e = 0;
+      try_inline(phi->args[k], bb, &e);
+    }
+  }
+}
+
+static Obj *new_home(Obj *fn) {
+  Obj *var = arena_alloc(&sym_arena, sizeof(Obj));
+  stats.objs++;
+  var->name = ".home";
+  var->ty = ty_int;
+  var->is_local = true;
+  var->next = fn->locals;
+  fn->locals = var;
+  return var;
+}
+
+static void schedule(Obj *fn) {
+  count_uses();
+  for (int i = 0; i < nblocks; i++) {
+    if (blocks[i]->reachable) {
+      schedule_block(blocks[i]);
+    }
+  }
+  for (int i = 0; i < nblocks; i++) {
+    Block *bb = blocks[i];
+    for (int j = 0; bb->reachable && j < bb->nvalues; j++) {
+      Value *v = bb->values[j];
+      if (v->live && v->nuses && !v->inlined && !is_remat(v)) {
+        v->home = new_home(fn);
+      }
+    }
+  }
+}
+
+static void optimize_function(Obj *fn) {
+  blocks = NULL;
+  nblocks = blocks_cap = 0;
+  defs = NULL;
+  defs_cap = defs_used = 0;
+
+  escapes = find_escape(fn->body);
+  // Parameters keep the stack slots they are stored to on entry.
+  for (Obj *var = fn->locals; var != fn->params; var = var->next) {
+    var->is_promoted = !escapes;
+  }
+
+  Block *entry = new_block();
+  enter(entry);
+  seal(entry);
+  for (Obj *var = fn->params; var; var = var->next) {
+    if (in_ssa(var)) {
+      put_def(entry, var, new_var(V_PARAM, var));
+    }
+  }
+  lower_stmt(fn->body);
+  remove_trivial_phis();
+
+  sccp(entry);
+  dce();
+  fn->blocks = blocks;
+  fn->nblocks = nblocks;
+  if (opt_flicm) {
+    licm(fn);
+  }
+  schedule(fn);
+}
+
+// The SSA form lives in ir_arena until codegen is done.
+void optimize(Obj *prog) {
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (fn->is_function && !fn->cached) {
+      optimize_function(fn);
+    }
+  }
+  block_work = NULL;
+  block_work_cap = 0;
+  value_work = NULL;
+  value_work_cap = 0;
+  pending = NULL;
+  pending_cap = 0;
+  effects = NULL;
+  effects_cap = 0;
+}
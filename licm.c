@@ -0,0 +1,187 @@
+#include "ycc.h"
+
+// Loop-invariant code motion over the SSA form. Each jump back to a block
+// that comes earlier in the source closes a loop: the blocks from which
+// the jump can be reached without going through that header. Values of
+// the loop whose operands are all defined outside of it are moved to the
+// preheader, the only block that enters the loop. Loops are processed
+// innermost first, so a value can move out through several levels.
+//
+// Arithmetic and comparisons are moved. Divisions are not, since they may
+// trap and the loop might not execute them at all. Loads are only moved
+// if they read a variable, which cannot fault, and the loop has neither
+// stores nor calls that could change it. Constants and addresses need no
+// moving: they are computed again wherever they are used.
+
+static int *mark;       // Per block id: the loop it was last found in
+static Block **work;    // Blocks whose predecessors are yet to be visited
+static Value **hoisted; // Values moved to the preheader
+static int nhoisted;
+static int hoisted_cap;
+
+static bool in_loop(Block *bb, int loop) { return mark[bb->id] == loop; }
+
+static bool is_invariant(Value *v, int loop, bool has_write) {
+  if (!v->live || v->lat == CONST) {
+    return false;
+  }
+  switch (v->kind) {
+  case V_LOAD:
+    if (has_write || v->args[0]->kind != V_ADDR) {
+      return false;
+    }
+    break;
+  case V_BINARY:
+    if (v->op == ND_DIV) {
+      return false;
+    }
+    break;
+  case V_NEG:
+  case V_SEXT8:
+    break;
+  default:
+    return false;
+  }
+  for (int i = 0; i < v->nargs; i++) {
+    if (!is_remat(v->args[i]) && in_loop(v->args[i]->bb, loop)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Finds the blocks of the loop with the given header, numbered loop, and
+// returns the last one in the source. Sets *has_write if any of them
+// stores or calls.
+static int find_loop(Block *header, int loop, bool *has_write) {
+  int nwork = 0;
+  int last = header->id;
+  mark[header->id] = loop;
+  for (int i = 0; i < header->npreds; i++) {
+    Block *from = header->preds[i].from;
+    if (header->preds[i].exec && from->id >= header->id) {
+      work[nwork++] = from;
+    }
+  }
+  while (nwork) {
+    Block *bb = work[--nwork];
+    if (in_loop(bb, loop)) {
+      continue;
+    }
+    mark[bb->id] = loop;
+    last = bb->id > last ? bb->id : last;
+    for (int i = 0; i < bb->nvalues; i++) {
+      Value *v = bb->values[i];
+      if (v->live && (v->kind == V_STORE || v->kind == V_CALL)) {
+        *has_write = true;
+      }
+    }
+    for (int i = 0; i < bb->npreds; i++) {
+      if (bb->preds[i].exec && !in_loop(bb->preds[i].from, loop)) {
+        work[nwork++] = bb->preds[i].from;
+      }
+    }
+  }
+  for (int i = 0; i < header->nvalues; i++) {
+    Value *v = header->values[i];
+    if (v->live && (v->kind == V_STORE || v->kind == V_CALL)) {
+      *has_write = true;
+    }
+  }
+  return last;
+}
+
+// Returns the block that enters the loop, if there is a single one that
+// has no other successor.
+static Block *find_preheader(Block *header, int loop) {
+  Block *pre = NULL;
+  for (int i = 0; i < header->npreds; i++) {
+    Block *from = header->preds[i].from;
+    if (!header->preds[i].exec || in_loop(from, loop)) {
+      continue;
+    }
+    if (pre || from->nsuccs != 1) {
+      return NULL;
+    }
+    pre = from;
+  }
+  return pre;
+}
+
+static void licm_loop(Obj *fn, Block *header) {
+  int loop = header->id + 1;
+  bool has_write = false;
+  int last = find_loop(header, loop, &has_write);
+  Block *pre = find_preheader(header, loop);
+  if (!pre) {
+    return;
+  }
+
+  // Blocks are visited in source order, so that operands defined in the
+  // loop are moved before their users.
+  nhoisted = 0;
+  for (int i = header->id; i <= last; i++) {
+    Block *bb = fn->blocks[i];
+    if (!in_loop(bb, loop)) {
+      continue;
+    }
+    int n = 0;
+    for (int j = 0; j < bb->nvalues; j++) {
+      Value *v = bb->values[j];
+      if (is_invariant(v, loop, has_write)) {
+        v->bb = pre;
+        if (nhoisted == hoisted_cap) {
+          hoisted_cap = hoisted_cap ? hoisted_cap * 2 : 16;
+          hoisted = realloc(hoisted, hoisted_cap * sizeof(Value *));
+          if (!hoisted) {
+            error("out of memory");
+          }
+        }
+        hoisted[nhoisted++] = v;
+        continue;
+      }
+      v->pos = n;
+      bb->values[n++] = v;
+    }
+    bb->nvalues = n;
+  }
+  if (!nhoisted) {
+    return;
+  }
+
+  Value **values =
+      arena_alloc(&ir_arena, (pre->nvalues + nhoisted) * sizeof(Value *));
+  memcpy(values, pre->values, pre->nvalues * sizeof(Value *));
+  for (int i = 0; i < nhoisted; i++) {
+    hoisted[i]->pos = pre->nvalues;
+    values[pre->nvalues++] = hoisted[i];
+  }
+  pre->values = values;
+  pre->values_cap = pre->nvalues;
+}
+
+// Runs over the SSA form of fn, after constant propagation and dead code
+// elimination.
+void licm(Obj *fn) {
+  // A block is pushed at most once per edge out of it.
+  mark = calloc(fn->nblocks, sizeof(int));
+  work = calloc(fn->nblocks * 2, sizeof(Block *));
+  if (!mark || !work) {
+    error("out of memory");
+  }
+  // Inner loops have their headers later in the source.
+  for (int i = fn->nblocks - 1; i >= 0; i--) {
+    Block *bb = fn->blocks[i];
+    for (int j = 0; bb->reachable && j < bb->npreds; j++) {
+      if (bb->preds[j].exec && bb->preds[j].from->id >= bb->id) {
+        licm_loop(fn, bb);
+        break;
+      }
+    }
+  }
+  free(mark);
+  free(work);
+  free(hoisted);
+  hoisted = NULL;
+  hoisted_cap = 0;
+}
@@ -1,17 +1,198 @@
 #include "ycc.h"
-#include <assert.h>
-#include <endian.h>
-#include <stdbool.h>
-#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "%s:invalid number of arguments\n", argv[0]);
-    return 1;
+static char *opt_o;
+static bool opt_fpipeline;
+static bool opt_c;
+int opt_fthreads;
+bool opt_fpeephole = true;
+static bool opt_finline = true;
+bool opt_flicm = true;
+bool opt_foptimize_sibling_calls = true;
+bool opt_fomit_frame_pointer = true;
+static bool opt_fpeephole_stats;
+static bool opt_ftime_report;
+static char *opt_stats;
+char *opt_cache;
+static long opt_cache_size = 256; // Megabytes
+static char *input;
+
+static void usage(int status) {
+  fprintf(stderr, "ycc [ -c ] [ -o <path> ] [ -fpipeline ] "
+                  "[ -fthreads=<n> ] [ -fno-peephole ] [ -fpeephole-stats ] "
+                  "[ -fno-inline ] [ -fno-licm ] "
+                  "[ -f[no-]optimize-sibling-calls ] "
+                  "[ -f[no-]omit-frame-pointer ] [ -ftime-report ] "
+                  "[ --stats=<path> ] [ --cache=<dir> ] [ --cache-size=<MB> ] "
+                  "<file>\n"
+                  "ycc --server=<socket>\n"
+                  "ycc --connect=<socket> <args>\n");
+  exit(status);
+}
+
+static void parse_args(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--help")) {
+      usage(0);
+    }
+    if (!strcmp(argv[i], "-o")) {
+      if (!argv[++i]) {
+        usage(1);
+      }
+      opt_o = argv[i];
+      continue;
+    }
+    if (!strncmp(argv[i], "-o", 2)) {
+      opt_o = argv[i] + 2;
+      continue;
+    }
+    if (!strcmp(argv[i], "-c")) {
+      opt_c = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fpipeline")) {
+      opt_fpipeline = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fno-peephole")) {
+      opt_fpeephole = false;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fno-inline")) {
+      opt_finline = false;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fno-licm")) {
+      opt_flicm = false;
+      continue;
+    }
+    if (!strcmp(argv[i], "-foptimize-sibling-calls")) {
+      opt_foptimize_sibling_calls = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fno-optimize-sibling-calls")) {
+      opt_foptimize_sibling_calls = false;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fomit-frame-pointer")) {
+      opt_fomit_frame_pointer = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fno-omit-frame-pointer")) {
+      opt_fomit_frame_pointer = false;
+      continue;
+    }
+    if (!strcmp(argv[i], "-fpeephole-stats")) {
+      opt_fpeephole_stats = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "-ftime-report")) {
+      opt_ftime_report = true;
+      continue;
+    }
+    if (!strncmp(argv[i], "--stats=", 8)) {
+      opt_stats = argv[i] + 8;
+      continue;
+    }
+    if (!strncmp(argv[i], "--cache=", 8)) {
+      opt_cache = argv[i] + 8;
+      continue;
+    }
+    if (!strncmp(argv[i], "--cache-size=", 13)) {
+      opt_cache_size = atol(argv[i] + 13);
+      if (opt_cache_size < 1) {
+        error("invalid cache size: %s", argv[i] + 13);
+      }
+      continue;
+    }
+    if (!strncmp(argv[i], "-fthreads=", 10)) {
+      opt_fthreads = atoi(argv[i] + 10);
+      if (opt_fthreads < 1) {
+        error("invalid thread count: %s", argv[i] + 10);
+      }
+      continue;
+    }
+    if (argv[i][0] == '-' && argv[i][1] != '\0') {
+      error("unknown argument: %s", argv[i]);
+    }
+    if (input) {
+      usage(1);
+    }
+    input = argv[i];
+  }
+  if (!input) {
+    usage(1);
+  }
+  if (!opt_fthreads) {
+    opt_fthreads = sysconf(_SC_NPROCESSORS_ONLN);
   }
+}
+
+// Returns a file descriptor for the output path, "-" being stdout.
+static int open_output(char *path) {
+  if (!path || !strcmp(path, "-")) {
+    return STDOUT_FILENO;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    error("cannot open output file: %s: %s", path, strerror(errno));
+  }
+  return fd;
+}
+
+int compile(int argc, char **argv) {
+  parse_args(argc, argv);
 
-  Token *tok = tokenize(argv[1]);
+  // With -fpipeline, tokenizing overlaps parsing and is counted in it.
+  phase_start(PHASE_TOKENIZE);
+  Token *tok =
+      opt_fpipeline ? tokenize_file_async(input) : tokenize_file(input);
+  phase_start(PHASE_PARSE);
   Obj *prog = parse(tok);
+  tokenize_wait();
+  phase_start(PHASE_FOLD);
+  fold(prog);
+  phase_start(PHASE_INLINE);
+  if (opt_finline) {
+    inline_functions(prog);
+  }
+  phase_start(PHASE_OPTIMIZE);
+  if (opt_cache) {
+    cache_open(opt_cache, opt_cache_size << 20);
+    cache_lookup(prog);
+  }
+  optimize(prog);
+  phase_start(PHASE_CODEGEN);
+  emit_open(open_output(opt_o), opt_c);
   codegen(prog);
+  phase_start(NPHASES);
+  if (opt_cache) {
+    cache_close(prog);
+  }
+
+  if (opt_fpeephole_stats) {
+    peephole_report(stderr);
+  }
+  if (opt_ftime_report) {
+    stats_report(stderr);
+  }
+  if (opt_stats) {
+    FILE *out = fdopen(open_output(opt_stats), "w");
+    stats_report_json(out);
+    fclose(out);
+  }
+  release_arenas();
   return 0;
 }
+
+int main(int argc, char *argv[]) {
+  if (argc == 2 && !strncmp(argv[1], "--server=", 9)) {
+    server_run(argv[1] + 9);
+  }
+  if (argc > 1 && !strncmp(argv[1], "--connect=", 10)) {
+    return client_run(argv[1] + 10, argc - 2, argv + 2);
+  }
+  return compile(argc, argv);
+}
@@ -2,11 +2,22 @@
 #include <stdio.h>
 #include <string.h>
 
+// Variables of every block scope. The outermost scope holds globals.
+typedef struct Scope Scope;
+struct Scope {
+  Scope *next;
+  HashMap vars;
+  Obj *locals; // Linked by scope_next
+};
+
 static Obj *locals;
 static Obj *globals;
+static HashMap string_literals; // Contents -> Obj
+static Scope *scope = &(Scope){};
 
 static Node *new_node(NodeKind kind, Token *tok) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = arena_alloc(&node_arena, sizeof(Node));
+  stats.nodes++;
   node->kind = kind;
   node->tok = tok;
   return node;
@@ -19,7 +30,7 @@ static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
   return node;
 }
 
-static Node *new_num(int val, Token *tok) {
+static Node *new_num(long val, Token *tok) {
   Node *node = new_node(ND_NUM, tok);
   node->val = val;
   return node;
@@ -30,22 +41,35 @@ static Node *new_unary(NodeKind kind, Node *expr, Token *tok) {
   return node;
 }
 
-static Obj *find_var(Token *tok) {
+static void enter_scope() {
+  Scope *sc = calloc(1, sizeof(Scope));
+  sc->next = scope;
+  scope = sc;
+}
 
-  for (Obj *var = locals; var; var = var->next) {
-    if (strlen(var->name) == tok->len &&
-        !strncmp(tok->loc, var->name, tok->len))
-      return var;
-  }
-  for (Obj *var = globals; var; var = var->next) {
-    if (strlen(var->name) == tok->len &&
-        !strncmp(tok->loc, var->name, tok->len))
+static void leave_scope() {
+  Scope *sc = scope;
+  scope = sc->next;
+  hashmap_free(&sc->vars);
+  free(sc);
+}
+
+static void push_scope(Obj *var) {
+  hashmap_put(&scope->vars, var->name, strlen(var->name), var);
+}
+
+static Obj *find_var(Token *tok) {
+  for (Scope *sc = scope; sc; sc = sc->next) {
+    Obj *var = hashmap_get(&sc->vars, tok->ident, tok->len);
+    if (var) {
       return var;
+    }
   }
   return NULL;
 }
 static Obj *new_var(char *name, Type *ty) {
-  Obj *var = calloc(1, sizeof(Obj));
+  Obj *var = arena_alloc(&sym_arena, sizeof(Obj));
+  stats.objs++;
   var->name = name;
   var->ty = ty;
   return var;
@@ -55,6 +79,9 @@ static Obj *new_lvar(char *name, Type *ty) {
   var->is_local = true;
   var->next = locals;
   locals = var;
+  var->scope_next = scope->locals;
+  scope->locals = var;
+  push_scope(var);
   return var;
 }
 
@@ -78,9 +105,22 @@ static char *new_unique_name() {
 
 static Obj *new_anon_gvar(Type *ty) { return new_gvar(new_unique_name(), ty); }
 
+static Obj *new_named_gvar(char *name, Type *ty) {
+  Obj *var = new_gvar(name, ty);
+  push_scope(var);
+  return var;
+}
+
+// Identical string literals share a single object.
 static Obj *new_string_literal(char *p, Type *ty) {
-  Obj *var = new_anon_gvar(ty);
+  Obj *var = hashmap_get(&string_literals, p, ty->size);
+  if (var) {
+    return var;
+  }
+  var = new_anon_gvar(ty);
   var->init_data = p;
+  var->is_literal = true;
+  hashmap_put(&string_literals, p, ty->size, var);
   return var;
 }
 
@@ -129,7 +169,9 @@ static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
   if (lhs->ty->base && rhs->ty->base) {
     Node *node = new_binary(ND_SUB, lhs, rhs, tok);
     node->ty = ty_int;
-    return new_binary(ND_DIV, node, new_num(lhs->ty->base->size, tok), tok);
+    node = new_binary(ND_DIV, node, new_num(lhs->ty->base->size, tok), tok);
+    node->is_exact = true;
+    return node;
   }
   error_tok(tok, "invalid operands");
 }
@@ -138,7 +180,7 @@ static char *get_ident(Token *tok) {
   if (tok->kind != TK_IDENT) {
     error_tok(tok, "expected an identifier");
   }
-  return strndup(tok->loc, tok->len);
+  return tok->ident;
 }
 
 static int get_number(Token *tok) {
@@ -149,7 +191,7 @@ static int get_number(Token *tok) {
 }
 
 static bool is_typename(Token *tok) {
-  return equal(tok, "char") || equal(tok, "int");
+  return tok->id == KW_CHAR || tok->id == KW_INT;
 }
 
 // stmt="return" expr ";"
@@ -196,9 +238,9 @@ static Node *primary(Token **rest, Token *tok);
 static Type *func_params(Token **rest, Token *tok, Type *ty) {
   Type head = {};
   Type *cur = &head;
-  while (!equal(tok, ")")) {
+  while (tok->id != ')') {
     if (cur != &head) {
-      tok = skip(tok, ",");
+      tok = skip(tok, ',');
     }
     Type *basety = declspec(&tok, tok);
     Type *ty = declarator(&tok, tok, basety);
@@ -206,19 +248,19 @@ static Type *func_params(Token **rest, Token *tok, Type *ty) {
   }
   ty = func_type(ty);
   ty->params = head.next;
-  *rest = tok->next;
+  *rest = tok_next(tok);
   return ty;
 }
 
 // type-suffix="(" func-params | "[" num "]"  type-suffix | ε
 static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
-  if (equal(tok, "(")) {
-    return func_params(rest, tok->next, ty);
+  if (tok->id == '(') {
+    return func_params(rest, tok_next(tok), ty);
   }
 
-  if (equal(tok, "[")) {
-    int sz = get_number(tok->next);
-    tok = skip(tok->next->next, "]");
+  if (tok->id == '[') {
+    int sz = get_number(tok_next(tok));
+    tok = skip(tok_next(tok_next(tok)), ']');
     ty = type_suffix(rest, tok, ty);
     return array_of(ty, sz);
   }
@@ -228,23 +270,23 @@ static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
 
 // declspec = "int" |"char"
 static Type *declspec(Token **rest, Token *tok) {
-  if (equal(tok, "char")) {
-    *rest = tok->next;
+  if (tok->id == KW_CHAR) {
+    *rest = tok_next(tok);
     return ty_char;
   }
-  *rest = skip(tok, "int");
+  *rest = skip(tok, KW_INT);
   return ty_int;
 }
 
 // declarator = "*"* ident type-suffix
 static Type *declarator(Token **rest, Token *tok, Type *ty) {
-  while (consume(&tok, tok, "*")) {
+  while (consume(&tok, tok, '*')) {
     ty = pointer_to(ty);
   }
   if (tok->kind != TK_IDENT) {
     error_tok(tok, "expected an identifier");
   }
-  ty = type_suffix(rest, tok->next, ty);
+  ty = type_suffix(rest, tok_next(tok), ty);
   ty->name = tok;
   return ty;
 }
@@ -255,24 +297,24 @@ static Node *declaration(Token **rest, Token *tok) {
   Node head = {};
   Node *cur = &head;
   int i = 0;
-  while (!equal(tok, ";")) {
+  while (tok->id != ';') {
     if (i++ > 0) {
-      tok = skip(tok, ",");
+      tok = skip(tok, ',');
     }
     Type *ty = declarator(&tok, tok, basety);
     Obj *var = new_lvar(get_ident(ty->name), ty);
-    if (!equal(tok, "=")) {
+    if (tok->id != '=') {
       continue;
     }
 
     Node *lhs = new_var_node(var, ty->name);
-    Node *rhs = assign(&tok, tok->next);
+    Node *rhs = assign(&tok, tok_next(tok));
     Node *node = new_binary(ND_ASSIGN, lhs, rhs, tok);
     cur = cur->next = new_unary(ND_EXPR_STMT, node, tok);
   }
   Node *node = new_node(ND_BLOCK, tok);
   node->body = head.next;
-  *rest = tok->next;
+  *rest = tok_next(tok);
   return node;
 }
 
@@ -282,52 +324,53 @@ static Node *declaration(Token **rest, Token *tok) {
 //      | "if" "(" expr ")" stmt ("else" stmt)
 //      | "for" "("expr-stmt expr-stmt expr?")" stmt
 static Node *stmt(Token **rest, Token *tok) {
-  if (equal(tok, "return")) {
-    Node *node = new_unary(ND_RETURN, expr(&tok, tok->next), tok);
-    *rest = skip(tok, ";");
+  switch (tok->id) {
+  case KW_RETURN: {
+    Node *node = new_unary(ND_RETURN, expr(&tok, tok_next(tok)), tok);
+    *rest = skip(tok, ';');
     return node;
   }
-  if (equal(tok, "{")) {
-    return compound_stmt(rest, tok->next);
-  }
-  if (equal(tok, "if")) {
+  case '{':
+    return compound_stmt(rest, tok_next(tok));
+  case KW_IF: {
     Node *node = new_node(ND_IF, tok);
-    tok = skip(tok->next, "(");
+    tok = skip(tok_next(tok), '(');
     node->cond = expr(&tok, tok);
-    tok = skip(tok, ")");
+    tok = skip(tok, ')');
     node->then = stmt(&tok, tok);
-    if (equal(tok, "else")) {
-      node->els = stmt(&tok, tok->next);
+    if (tok->id == KW_ELSE) {
+      node->els = stmt(&tok, tok_next(tok));
     }
     *rest = tok;
     return node;
   }
-  if (equal(tok, "for")) {
+  case KW_FOR: {
     Node *node = new_node(ND_FOR, tok);
-    tok = skip(tok->next, "(");
+    tok = skip(tok_next(tok), '(');
     node->init = expr_stmt(&tok, tok);
 
-    if (!equal(tok, ";"))
+    if (tok->id != ';')
       node->cond = expr(&tok, tok);
-    tok = skip(tok, ";");
+    tok = skip(tok, ';');
 
-    if (!equal(tok, ")"))
+    if (tok->id != ')')
       node->inc = expr(&tok, tok);
-    tok = skip(tok, ")");
+    tok = skip(tok, ')');
 
     node->then = stmt(&tok, tok);
     *rest = tok;
     return node;
   }
-  if (equal(tok, "while")) {
+  case KW_WHILE: {
     Node *node = new_node(ND_FOR, tok);
-    tok = skip(tok->next, "(");
+    tok = skip(tok_next(tok), '(');
     node->cond = expr(&tok, tok);
-    tok = skip(tok, ")");
+    tok = skip(tok, ')');
     node->then = stmt(&tok, tok);
     *rest = tok;
     return node;
   }
+  }
   return expr_stmt(rest, tok);
 }
 
@@ -335,7 +378,8 @@ static Node *stmt(Token **rest, Token *tok) {
 static Node *compound_stmt(Token **rest, Token *tok) {
   Node head = {};
   Node *cur = &head;
-  while (!equal(tok, "}")) {
+  enter_scope();
+  while (tok->id != '}') {
     if (is_typename(tok)) {
       cur = cur->next = declaration(&tok, tok);
     } else {
@@ -345,19 +389,21 @@ static Node *compound_stmt(Token **rest, Token *tok) {
   }
   Node *node = new_node(ND_BLOCK, tok);
   node->body = head.next;
+  node->locals = scope->locals;
+  leave_scope();
   // skip "}"
-  *rest = tok->next;
+  *rest = tok_next(tok);
   return node;
 }
 
 // expr-stmt=expr? ";"
 static Node *expr_stmt(Token **rest, Token *tok) {
-  if (equal(tok, ";")) {
-    *rest = tok->next;
+  if (tok->id == ';') {
+    *rest = tok_next(tok);
     return new_node(ND_BLOCK, tok);
   }
   Node *node = new_unary(ND_EXPR_STMT, expr(&tok, tok), tok);
-  *rest = skip(tok, ";");
+  *rest = skip(tok, ';');
   return node;
 }
 
@@ -368,8 +414,8 @@ static Node *expr(Token **rest, Token *tok) { return assign(rest, tok); }
 static Node *assign(Token **rest, Token *tok) {
   Node *node = equality(&tok, tok);
   while (true) {
-    if (equal(tok, "=")) {
-      node = new_binary(ND_ASSIGN, node, assign(&tok, tok->next), tok);
+    if (tok->id == '=') {
+      node = new_binary(ND_ASSIGN, node, assign(&tok, tok_next(tok)), tok);
       continue;
     }
     *rest = tok;
@@ -381,12 +427,12 @@ static Node *equality(Token **rest, Token *tok) {
   Node *node = relational(&tok, tok);
   while (true) {
     Token *start = tok;
-    if (equal(tok, "==")) {
-      node = new_binary(ND_EQ, node, relational(&tok, tok->next), start);
+    switch (tok->id) {
+    case PT_EQ:
+      node = new_binary(ND_EQ, node, relational(&tok, tok_next(tok)), start);
       continue;
-    }
-    if (equal(tok, "!=")) {
-      node = new_binary(ND_NE, node, relational(&tok, tok->next), start);
+    case PT_NE:
+      node = new_binary(ND_NE, node, relational(&tok, tok_next(tok)), start);
       continue;
     }
     *rest = tok;
@@ -399,20 +445,18 @@ static Node *relational(Token **rest, Token *tok) {
   Node *node = add(&tok, tok);
   while (true) {
     Token *start = tok;
-    if (equal(tok, "<")) {
-      node = new_binary(ND_LT, node, add(&tok, tok->next), start);
+    switch (tok->id) {
+    case '<':
+      node = new_binary(ND_LT, node, add(&tok, tok_next(tok)), start);
       continue;
-    }
-    if (equal(tok, "<=")) {
-      node = new_binary(ND_LE, node, add(&tok, tok->next), start);
+    case PT_LE:
+      node = new_binary(ND_LE, node, add(&tok, tok_next(tok)), start);
       continue;
-    }
-    if (equal(tok, ">")) {
-      node = new_binary(ND_LT, add(&tok, tok->next), node, start);
+    case '>':
+      node = new_binary(ND_LT, add(&tok, tok_next(tok)), node, start);
       continue;
-    }
-    if (equal(tok, ">=")) {
-      node = new_binary(ND_LE, add(&tok, tok->next), node, start);
+    case PT_GE:
+      node = new_binary(ND_LE, add(&tok, tok_next(tok)), node, start);
       continue;
     }
     *rest = tok;
@@ -424,13 +468,13 @@ static Node *relational(Token **rest, Token *tok) {
 static Node *add(Token **rest, Token *tok) {
   Node *node = mul(&tok, tok);
   while (true) {
-    Token *start;
-    if (equal(tok, "+")) {
-      node = new_add(node, mul(&tok, tok->next), tok);
+    Token *start = tok;
+    switch (tok->id) {
+    case '+':
+      node = new_add(node, mul(&tok, tok_next(tok)), start);
       continue;
-    }
-    if (equal(tok, "-")) {
-      node = new_sub(node, mul(&tok, tok->next), tok);
+    case '-':
+      node = new_sub(node, mul(&tok, tok_next(tok)), start);
       continue;
     }
     *rest = tok;
@@ -443,12 +487,12 @@ static Node *mul(Token **rest, Token *tok) {
   Node *node = unary(&tok, tok);
   while (true) {
     Token *start = tok;
-    if (equal(tok, "*")) {
-      node = new_binary(ND_MUL, node, unary(&tok, tok->next), start);
+    switch (tok->id) {
+    case '*':
+      node = new_binary(ND_MUL, node, unary(&tok, tok_next(tok)), start);
       continue;
-    }
-    if (equal(tok, "/")) {
-      node = new_binary(ND_DIV, node, unary(&tok, tok->next), start);
+    case '/':
+      node = new_binary(ND_DIV, node, unary(&tok, tok_next(tok)), start);
       continue;
     }
     *rest = tok;
@@ -457,17 +501,15 @@ static Node *mul(Token **rest, Token *tok) {
 }
 // unary= ("+"|”-" | "&" | "*") unary | postfix
 static Node *unary(Token **rest, Token *tok) {
-  if (equal(tok, "+")) {
-    return unary(rest, tok->next);
-  }
-  if (equal(tok, "-")) {
-    return new_unary(ND_NEG, unary(rest, tok->next), tok);
-  }
-  if (equal(tok, "&")) {
-    return new_unary(ND_ADDR, unary(rest, tok->next), tok);
-  }
-  if (equal(tok, "*")) {
-    return new_unary(ND_DEREF, unary(rest, tok->next), tok);
+  switch (tok->id) {
+  case '+':
+    return unary(rest, tok_next(tok));
+  case '-':
+    return new_unary(ND_NEG, unary(rest, tok_next(tok)), tok);
+  case '&':
+    return new_unary(ND_ADDR, unary(rest, tok_next(tok)), tok);
+  case '*':
+    return new_unary(ND_DEREF, unary(rest, tok_next(tok)), tok);
   }
   return postfix(rest, tok);
 }
@@ -475,11 +517,11 @@ static Node *unary(Token **rest, Token *tok) {
 // postfix=primar ("[" expr"]")*
 static Node *postfix(Token **rest, Token *tok) {
   Node *node = primary(&tok, tok);
-  while (equal(tok, "[")) {
+  while (tok->id == '[') {
     Token *start = tok;
-    Node *idx = expr(&tok, tok->next);
+    Node *idx = expr(&tok, tok_next(tok));
 
-    tok = skip(tok, "]");
+    tok = skip(tok, ']');
     node = new_unary(ND_DEREF, new_add(node, idx, start), start);
   }
   *rest = tok;
@@ -489,18 +531,18 @@ static Node *postfix(Token **rest, Token *tok) {
 // funcall=ident "(" (assign ("," assign)* )?")"
 static Node *funcall(Token **rest, Token *tok) {
   Token *start = tok;
-  tok = tok->next->next;
+  tok = tok_next(tok_next(tok));
   Node head = {};
   Node *cur = &head;
-  while (!equal(tok, ")")) {
+  while (tok->id != ')') {
     if (cur != &head) {
-      tok = skip(tok, ",");
+      tok = skip(tok, ',');
     }
     cur = cur->next = assign(&tok, tok);
   }
-  *rest = skip(tok, ")");
+  *rest = skip(tok, ')');
   Node *node = new_node(ND_FUNCALL, start);
-  node->funcname = strndup(start->loc, start->len);
+  node->funcname = start->ident;
   node->args = head.next;
   return node;
 }
@@ -508,40 +550,42 @@ static Node *funcall(Token **rest, Token *tok) {
 // primary ="(" expr ")" | num | ident args?  |num | str | "(" "{" stmt+ "}"")"
 // args="("")"
 static Node *primary(Token **rest, Token *tok) {
-  if (equal(tok, "(") && equal(tok->next, "{")) {
+  if (tok->id == '(' && tok_next(tok)->id == '{') {
     Node *node = new_node(ND_STMT_EXPR, tok);
-    node->body = compound_stmt(&tok, tok->next->next)->body;
-    *rest = skip(tok, ")");
+    Node *block = compound_stmt(&tok, tok_next(tok_next(tok)));
+    node->body = block->body;
+    node->locals = block->locals;
+    *rest = skip(tok, ')');
     return node;
   }
-  if (equal(tok, "(")) {
-    Node *node = expr(&tok, tok->next);
-    *rest = skip(tok, ")");
+  if (tok->id == '(') {
+    Node *node = expr(&tok, tok_next(tok));
+    *rest = skip(tok, ')');
     return node;
   }
   if (tok->kind == TK_NUM) {
     Node *node = new_num(tok->val, tok);
-    *rest = tok->next;
+    *rest = tok_next(tok);
     return node;
   }
   if (tok->kind == TK_IDENT) {
-    if (equal(tok->next, "(")) {
+    if (tok_next(tok)->id == '(') {
       return funcall(rest, tok);
     }
     Obj *var = find_var(tok);
     if (!var) {
       error_tok(tok, "undefined variable");
     }
-    *rest = tok->next;
+    *rest = tok_next(tok);
     return new_var_node(var, tok);
   }
   if (tok->kind == TK_STR) {
-    Obj *var = new_string_literal(tok->str, tok->ty);
-    *rest = tok->next;
+    Obj *var = new_string_literal(tok->str, array_of(ty_char, tok->val));
+    *rest = tok_next(tok);
     return new_var_node(var, tok);
   }
-  if (equal(tok, "sizeof")) {
-    Node *node = unary(rest, tok->next);
+  if (tok->id == KW_SIZEOF) {
+    Node *node = unary(rest, tok_next(tok));
     add_type(node);
     return new_num(node->ty->size, tok);
   }
@@ -558,31 +602,33 @@ static void create_param_lvars(Type *param) {
 
 static Token *function(Token *tok, Type *basety) {
   Type *ty = declarator(&tok, tok, basety);
-  Obj *fn = new_gvar(get_ident(ty->name), ty);
+  Obj *fn = new_named_gvar(get_ident(ty->name), ty);
   fn->is_function = true;
   locals = NULL;
+  enter_scope();
   create_param_lvars(ty->params);
   fn->params = locals;
-  tok = skip(tok, "{");
+  tok = skip(tok, '{');
   fn->body = compound_stmt(&tok, tok);
   fn->locals = locals;
+  leave_scope();
   return tok;
 }
 
 static Token *global_variable(Token *tok, Type *basety) {
   bool first = true;
-  while (!consume(&tok, tok, ";")) {
+  while (!consume(&tok, tok, ';')) {
     if (!first) {
-      tok = skip(tok, ",");
+      tok = skip(tok, ',');
     }
     first = false;
     Type *ty = declarator(&tok, tok, basety);
-    new_gvar(get_ident(ty->name), ty);
+    new_named_gvar(get_ident(ty->name), ty);
   }
   return tok;
 }
 static bool is_function(Token *tok) {
-  if (equal(tok->next, ";")) {
+  if (tok_next(tok)->id == ';') {
     return false;
   }
   Type dummy = {};
@@ -601,5 +647,6 @@ Obj *parse(Token *tok) {
     }
     tok = global_variable(tok, basety);
   }
+  hashmap_free(&string_literals);
   return globals;
 }
@@ -0,0 +1,199 @@
+#include "ycc.h"
+
+// Peephole optimizer. Instructions of a function are collected in a list
+// before they are printed or encoded; each time one is appended, the
+// rules are tried on a window at the end of the list. A rule that
+// matches rewrites its window in place, possibly shortening the list,
+// and the rules are tried again, so rewrites can cascade backwards.
+//
+// Some rules rely on how codegen uses registers: %rax is dead after a
+// conditional branch, and a temporary register read by an arithmetic
+// instruction has been popped off the temporary stack and is dead.
+
+typedef struct {
+  char *name;
+  int len; // Window size
+  // Returns the number of instructions the window was rewritten to, or
+  // -1 if the rule doesn't apply.
+  int (*fn)(Insn *w);
+  long count;
+} Rule;
+
+static bool is_reg(Operand *op, Reg r) {
+  return op->kind == OP_REG && op->size == 8 && op->reg == r;
+}
+
+static bool uses_reg(Operand *op, Reg r) {
+  if (op->kind == OP_MEM && op->scale && op->index == r) {
+    return true;
+  }
+  return (op->kind == OP_REG || op->kind == OP_MEM) && op->reg == r;
+}
+
+static bool is_imm(Operand *op, long val) {
+  return op->kind == OP_IMM && op->val == val;
+}
+
+static bool is_int32(Operand *op) {
+  return op->kind == OP_IMM && op->val == (int)op->val;
+}
+
+// Reports whether the instruction sets %rax regardless of its old value.
+static bool defines_rax(Insn *insn) {
+  switch (insn->op) {
+  case I_MOV:
+  case I_MOVSBQ:
+  case I_LEA:
+    return is_reg(&insn->dst, RAX) && !uses_reg(&insn->src, RAX);
+  }
+  return false;
+}
+
+// lea M,%rax; mov (%rax),%rax => mov M,%rax
+static int load_addr(Insn *w) {
+  if (w[0].op == I_LEA && is_reg(&w[0].dst, RAX) &&
+      (w[1].op == I_MOV || w[1].op == I_MOVSBQ) &&
+      w[1].src.kind == OP_MEM && w[1].src.reg == RAX && !w[1].src.scale &&
+      w[1].src.val == 0 && is_reg(&w[1].dst, RAX)) {
+    w[0].op = w[1].op;
+    return 1;
+  }
+  return -1;
+}
+
+// mov A,%rax; mov %rax,%rdi; mov B,%rax => mov A,%rdi; mov B,%rax
+static int forward_temp(Insn *w) {
+  if ((w[0].op == I_MOV || w[0].op == I_MOVSBQ || w[0].op == I_LEA) &&
+      is_reg(&w[0].dst, RAX) && w[1].op == I_MOV &&
+      is_reg(&w[1].src, RAX) && w[1].dst.kind == OP_REG &&
+      w[1].dst.size == 8 && w[1].dst.reg != RAX && defines_rax(&w[2])) {
+    w[0].dst = w[1].dst;
+    w[1] = w[2];
+    return 2;
+  }
+  return -1;
+}
+
+// mov A,%rdi; mov B,%rax; add %rdi,%rax => mov B,%rax; add A,%rax
+static int fold_operand(Insn *w) {
+  Operand *a = &w[0].src;
+  if (w[0].op != I_MOV || w[0].dst.kind != OP_REG || w[0].dst.size != 8 ||
+      w[0].dst.reg == RAX) {
+    return -1;
+  }
+  Reg r = w[0].dst.reg;
+  if (!(is_int32(a) ||
+        (a->kind == OP_MEM && !uses_reg(a, RAX) && !uses_reg(a, r)) ||
+        a->kind == OP_SYM)) {
+    return -1;
+  }
+  if (!defines_rax(&w[1]) || uses_reg(&w[1].src, r)) {
+    return -1;
+  }
+  switch (w[2].op) {
+  case I_ADD:
+  case I_SUB:
+  case I_IMUL:
+  case I_CMP:
+    if (is_reg(&w[2].src, r) && is_reg(&w[2].dst, RAX)) {
+      w[2].src = *a;
+      w[0] = w[1];
+      w[1] = w[2];
+      return 2;
+    }
+  }
+  return -1;
+}
+
+// sete %al; movzb %al,%rax; cmp $0,%rax; je L => jne L
+static int branch_on_flags(Insn *w) {
+  static Mnemonic inverse[] = {
+      [I_SETE] = I_JNE, [I_SETNE] = I_JE, [I_SETL] = I_JGE, [I_SETLE] = I_JG,
+  };
+  switch (w[0].op) {
+  case I_SETE:
+  case I_SETNE:
+  case I_SETL:
+  case I_SETLE:
+    break;
+  default:
+    return -1;
+  }
+  if (w[1].op == I_MOVZB && is_reg(&w[1].dst, RAX) && w[2].op == I_CMP &&
+      is_imm(&w[2].src, 0) && is_reg(&w[2].dst, RAX) && w[3].op == I_JE) {
+    w[0] = (Insn){inverse[w[0].op], .dst = w[3].dst};
+    return 1;
+  }
+  return -1;
+}
+
+static bool same_label(Operand *a, Operand *b) {
+  return a->kind == OP_LABEL && b->kind == OP_LABEL && a->val == b->val &&
+         !strcmp(a->name, b->name);
+}
+
+// jmp L; L: => L:
+static int jump_to_next(Insn *w) {
+  if (w[0].op == I_JMP && w[1].op == I_LABEL &&
+      same_label(&w[0].dst, &w[1].dst)) {
+    w[0] = w[1];
+    return 1;
+  }
+  return -1;
+}
+
+// add $0,%rsp => (nothing)
+static int zero_adjust(Insn *w) {
+  if ((w[0].op == I_ADD || w[0].op == I_SUB) && is_imm(&w[0].src, 0) &&
+      w[0].dst.kind == OP_REG) {
+    return 0;
+  }
+  return -1;
+}
+
+// mov %rax,%rax => (nothing)
+static int self_move(Insn *w) {
+  if (w[0].op == I_MOV && w[0].src.kind == OP_REG && w[0].src.size == 8 &&
+      is_reg(&w[0].dst, w[0].src.reg)) {
+    return 0;
+  }
+  return -1;
+}
+
+static Rule rules[] = {
+    {"load-addr", 2, load_addr},
+    {"forward-temp", 3, forward_temp},
+    {"fold-operand", 3, fold_operand},
+    {"branch-on-flags", 4, branch_on_flags},
+    {"jump-to-next", 2, jump_to_next},
+    {"zero-adjust", 1, zero_adjust},
+    {"self-move", 1, self_move},
+};
+
+#define NRULES (int)(sizeof(rules) / sizeof(*rules))
+
+// Applies the rules to the end of a list of n instructions, the last of
+// which was just appended. Returns the new length of the list.
+int peephole(Insn *insns, int n) {
+  for (int i = 0; i < NRULES; i++) {
+    Rule *rule = &rules[i];
+    if (n < rule->len) {
+      continue;
+    }
+    Insn *w = insns + n - rule->len;
+    int m = rule->fn(w);
+    if (m < 0) {
+      continue;
+    }
+    __atomic_fetch_add(&rule->count, 1, __ATOMIC_RELAXED);
+    n += m - rule->len;
+    i = -1;
+  }
+  return n;
+}
+
+void peephole_report(FILE *out) {
+  for (int i = 0; i < NRULES; i++) {
+    fprintf(out, "peephole %-16s %ld\n", rules[i].name, rules[i].count);
+  }
+}
@@ -0,0 +1,244 @@
+#include "ycc.h"
+#include <errno.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Compile server. ycc --server=<socket> listens on a UNIX socket, and
+// ycc --connect=<socket> <args> hands its command line, working
+// directory and standard streams over to it instead of compiling itself.
+//
+// The server keeps a pool of idle children forked in advance, one per
+// CPU, each waiting to accept a connection. A child that accepts one
+// tells the server, which forks a replacement, compiles the request and
+// reports its exit status to the client as it exits. So fork is off the
+// path of a request, yet every compilation starts from the server's
+// pristine static state and empty arenas, all of its memory is reclaimed
+// when it ends, and an error, which exits, only ends that compilation.
+//
+// A request is a length-prefixed list of NUL-terminated strings, the
+// working directory followed by the arguments, sent along with the
+// client's stdin, stdout and stderr. The reply is the exit status.
+
+#define MAX_REQUEST (1 << 20)
+
+static bool read_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static struct sockaddr_un socket_addr(char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    error("socket path too long: %s", path);
+  }
+  strcpy(addr.sun_path, path);
+  return addr;
+}
+
+// Receives a request with the client's standard streams and makes them
+// ours. Returns the arguments, with argv[0] set, or NULL.
+static char **receive(int conn, int *argc) {
+  int len;
+  int fds[3];
+  char cbuf[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = {&len, sizeof(len)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = cbuf,
+                       .msg_controllen = sizeof(cbuf)};
+  if (recvmsg(conn, &msg, MSG_WAITALL) != sizeof(len)) {
+    return NULL;
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds)) || len <= 0 ||
+      len > MAX_REQUEST) {
+    return NULL;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  for (int i = 0; i < 3; i++) {
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+
+  char *buf = malloc(len + 1);
+  if (!read_all(conn, buf, len)) {
+    return NULL;
+  }
+  buf[len] = '\0';
+  if (chdir(buf)) {
+    error("cannot change directory: %s: %s", buf, strerror(errno));
+  }
+
+  // The directory takes the place of argv[0].
+  int n = 0;
+  for (char *p = buf; p < buf + len; p += strlen(p) + 1) {
+    n++;
+  }
+  char **argv = calloc(n + 1, sizeof(char *));
+  int i = 0;
+  for (char *p = buf; p < buf + len; p += strlen(p) + 1) {
+    argv[i++] = p;
+  }
+  argv[0] = "ycc";
+  *argc = n;
+  return argv;
+}
+
+static int conn = -1;
+static int busy[2]; // Pipe on which children announce taking a request
+
+// Sends the exit status of the compilation, however it exits.
+static void reply(int status, void *arg) {
+  status &= 0xff;
+  write_all(conn, &status, sizeof(status));
+}
+
+// Runs in a child of the server: waits for a request and compiles it.
+// An idle child exits with the server, a busy one finishes its request.
+static void serve(int fd, pid_t server) {
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != server) {
+    _exit(0);
+  }
+  while ((conn = accept(fd, NULL, NULL)) < 0) {
+    if (errno != EINTR && errno != ECONNABORTED) {
+      error("cannot accept connection: %s", strerror(errno));
+    }
+  }
+  prctl(PR_SET_PDEATHSIG, 0);
+  close(fd);
+  write_all(busy[1], "", 1);
+  close(busy[1]);
+
+  int argc;
+  char **argv = receive(conn, &argc);
+  if (!argv) {
+    _exit(1);
+  }
+  on_exit(reply, NULL);
+  exit(compile(argc, argv));
+}
+
+// The socket is bound under a temporary name and renamed once it is
+// listening, so a client never finds one it can't connect to.
+void server_run(char *path) {
+  char *tmp = format("%s.%d", path, getpid());
+  struct sockaddr_un addr = socket_addr(tmp);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    error("cannot create socket: %s", strerror(errno));
+  }
+  unlink(tmp);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 128) ||
+      rename(tmp, path)) {
+    error("cannot listen on %s: %s", path, strerror(errno));
+  }
+
+  if (pipe(busy)) {
+    error("cannot create pipe: %s", strerror(errno));
+  }
+  // Children are reaped automatically.
+  signal(SIGCHLD, SIG_IGN);
+  pid_t server = getpid();
+  int idle = 0;
+  for (int pool = sysconf(_SC_NPROCESSORS_ONLN);;) {
+    for (; idle < pool; idle++) {
+      pid_t pid = fork();
+      if (pid < 0) {
+        error("cannot fork: %s", strerror(errno));
+      }
+      if (pid == 0) {
+        close(busy[0]);
+        serve(fd, server);
+      }
+    }
+    char c;
+    if (read(busy[0], &c, 1) == 1) {
+      idle--;
+    }
+  }
+}
+
+// Sends the command line to the server and returns the exit status of
+// the compilation.
+int client_run(char *path, int argc, char **argv) {
+  struct sockaddr_un addr = socket_addr(path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    error("cannot connect to %s: %s", path, strerror(errno));
+  }
+
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd) {
+    error("cannot get working directory: %s", strerror(errno));
+  }
+  int len = strlen(cwd) + 1;
+  for (int i = 0; i < argc; i++) {
+    len += strlen(argv[i]) + 1;
+  }
+  if (len > MAX_REQUEST) {
+    error("command line too long");
+  }
+  char *buf = malloc(len);
+  char *p = stpcpy(buf, cwd) + 1;
+  for (int i = 0; i < argc; i++) {
+    p = stpcpy(p, argv[i]) + 1;
+  }
+  free(cwd);
+
+  int fds[] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  char cbuf[CMSG_SPACE(sizeof(fds))] = {};
+  struct iovec iov = {&len, sizeof(len)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = cbuf,
+                       .msg_controllen = sizeof(cbuf)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (sendmsg(fd, &msg, 0) != sizeof(len) || !write_all(fd, buf, len)) {
+    error("cannot send request to %s: %s", path, strerror(errno));
+  }
+  free(buf);
+
+  // The compilation crashed if it closed the connection without a reply.
+  int status;
+  if (!read_all(fd, &status, sizeof(status))) {
+    error("compilation by %s failed", path);
+  }
+  close(fd);
+  return status;
+}
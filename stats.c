@@ -0,0 +1,98 @@
+#include "ycc.h"
+#include <sys/resource.h>
+#include <time.h>
+
+// Per-phase timing for -ftime-report. main marks where each phase starts;
+// a phase ends where the next one starts. Wall time is read from the
+// monotonic clock, and CPU time is that of the whole process, so it
+// exceeds wall time while codegen runs on several threads.
+
+typedef struct {
+  char *name;
+  double wall; // Seconds
+  double cpu;  // Seconds
+  size_t bytes; // Allocated from arenas
+} PhaseTime;
+
+Stats stats;
+
+static PhaseTime phases[] = {
+    [PHASE_TOKENIZE] = {"tokenize"}, [PHASE_PARSE] = {"parse"},
+    [PHASE_FOLD] = {"fold"},         [PHASE_INLINE] = {"inline"},
+    [PHASE_OPTIMIZE] = {"optimize"}, [PHASE_CODEGEN] = {"codegen"},
+};
+
+static Phase running = NPHASES;
+static double start_wall;
+static double start_cpu;
+static size_t start_bytes;
+
+static double now(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Ends the running phase, if any, and starts the given one. NPHASES
+// just ends the running phase.
+void phase_start(Phase phase) {
+  double wall = now(CLOCK_MONOTONIC);
+  double cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+  size_t bytes = arena_total();
+  if (running != NPHASES) {
+    phases[running].wall += wall - start_wall;
+    phases[running].cpu += cpu - start_cpu;
+    phases[running].bytes += bytes - start_bytes;
+  }
+  running = phase;
+  start_wall = wall;
+  start_cpu = cpu;
+  start_bytes = bytes;
+}
+
+// Returns the peak resident set size in kilobytes.
+static long peak_rss(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+void stats_report(FILE *out) {
+  PhaseTime total = {"total"};
+  fprintf(out, "%-10s %10s %10s %12s\n", "phase", "wall(ms)", "cpu(ms)",
+          "arena(KB)");
+  for (int i = 0; i <= NPHASES; i++) {
+    PhaseTime *p = i < NPHASES ? &phases[i] : &total;
+    fprintf(out, "%-10s %10.3f %10.3f %12.1f\n", p->name, p->wall * 1e3,
+            p->cpu * 1e3, p->bytes / 1024.0);
+    total.wall += p->wall;
+    total.cpu += p->cpu;
+    total.bytes += p->bytes;
+  }
+  fprintf(out, "tokens %ld, nodes %ld, types %ld, objects %ld, "
+               "instructions %ld\n",
+          stats.tokens, stats.nodes, stats.types, stats.objs,
+          emit_insn_count());
+  if (opt_cache) {
+    fprintf(out, "cache hits %ld, misses %ld\n", stats.cache_hits,
+            stats.cache_misses);
+  }
+  fprintf(out, "peak RSS %ld KB\n", peak_rss());
+}
+
+void stats_report_json(FILE *out) {
+  fprintf(out, "{\"phases\": [");
+  for (int i = 0; i < NPHASES; i++) {
+    PhaseTime *p = &phases[i];
+    fprintf(out,
+            "%s\n  {\"name\": \"%s\", \"wall_ms\": %.3f, \"cpu_ms\": %.3f, "
+            "\"bytes\": %zu}",
+            i ? "," : "", p->name, p->wall * 1e3, p->cpu * 1e3, p->bytes);
+  }
+  fprintf(out, "],\n \"counts\": {\"tokens\": %ld, \"nodes\": %ld, "
+               "\"types\": %ld, \"objects\": %ld, \"instructions\": %ld, "
+               "\"cache_hits\": %ld, \"cache_misses\": %ld},\n",
+          stats.tokens, stats.nodes, stats.types, stats.objs,
+          emit_insn_count(), stats.cache_hits, stats.cache_misses);
+  fprintf(out, " \"peak_rss_kb\": %ld}\n", peak_rss());
+}
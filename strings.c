@@ -1,13 +1,27 @@
 #include "ycc.h"
 
+// Returns a formatted string allocated in the symbol arena.
 char *format(char *fmt, ...) {
-  char *buf;
-  size_t buflen;
-  FILE *out = open_memstream(&buf, &buflen);
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(out, fmt, ap);
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+
+  char *buf = arena_alloc(&sym_arena, len + 1);
+  va_start(ap, fmt);
+  vsnprintf(buf, len + 1, fmt, ap);
   va_end(ap);
-  fclose(out);
   return buf;
 }
+
+// Returns the canonical copy of an identifier, so that equal names are
+// always represented by the same pointer.
+char *intern(char *p, int len) {
+  static HashMap names;
+  char *name = hashmap_get(&names, p, len);
+  if (!name) {
+    name = arena_strndup(&tok_arena, p, len);
+    hashmap_put(&names, name, len, name);
+  }
+  return name;
+}
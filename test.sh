@@ -7,13 +7,20 @@ int sub(int x, int y) { return x-y; }
 int add6(int a, int b, int c, int d, int e, int f) {
   return a+b+c+d+e+f;
 }
+int sub8(int a, int b, int c, int d, int e, int f, int g, int h) {
+  return a-b-c-d-e-f-g-h;
+}
 EOF
+# With -c, ycc writes an object file instead of assembly.
+out=tmp.s
+case " $YCCFLAGS " in *" -c "*) out=tmp1.o ;; esac
+
 assert() {
   expected="$1"
   input="$2"
 
-  ./ycc "$input" > tmp.s || exit
-  gcc -static -o tmp tmp.s tmp2.o
+  echo "$input" | ./ycc $YCCFLAGS -o $out - || exit
+  gcc -static -o tmp $out tmp2.o
   ./tmp
   actual="$?"
 
@@ -25,8 +32,32 @@ assert() {
   fi
 }
 
+# Compiles tmp.src by its path, so that it is mapped rather than read.
+assert_file() {
+  expected="$1"
+
+  ./ycc $YCCFLAGS -o $out tmp.src || exit
+  gcc -static -o tmp $out tmp2.o
+  ./tmp
+  actual="$?"
+
+  if [ "$actual" = "$expected" ]; then
+    echo "tmp.src => $actual"
+  else
+    echo "tmp.src => $expected expected, but got $actual"
+    exit 1
+  fi
+}
+
 assert 0 'int main() { return 0; }'
 assert 42 'int main() { return 42; }'
+printf 'int main() { return 42; }' >tmp.src
+assert_file 42
+# A file of exactly one page, with no newline after the last token.
+prog='int main() { return 12345; }'
+{ printf '%*s' $((4096 - ${#prog})) ''; printf '%s' "$prog"; } >tmp.src
+[ $(wc -c <tmp.src) = 4096 ] || { echo "tmp.src is not 4096 bytes"; exit 1; }
+assert_file 57
 assert 21 'int main() { return 5+20-4; }'
 assert 41 'int main() { return  12 + 34 - 5 ; }'
 assert 47 'int main() { return 5+6*7; }'
@@ -36,6 +67,17 @@ assert 10 'int main() { return -10+20; }'
 assert 10 'int main() { return - -10; }'
 assert 10 'int main() { return - - +10; }'
 
+assert 78 'int main() { return 1+2+3+4+5+6+7+8+9+10+11+12; }'
+assert 6 'int main() { return 12/4+1+2; }'
+assert 75 'int main() { return 120/4+1+2+3+4+5+6+7+8+9; }'
+assert 15 'int main() { return 1+2+add(3,4)+5; }'
+assert 9 'int main() { int x; (x=9)+1+2+3+4+5+6+7+8; return x; }'
+assert 73 'int main() { return add6(1,2,3,4,5,add(6,7))+1+2+3+4+5+6+7+8+9; }'
+
+assert 27 'int main() { int x=3; return x*1+0-(x-x)+2*3*4+0*x; }'
+assert 2 'int main() { return (2147483647+2147483647)/2147483647; }'
+assert 5 'int main() { int a[4]; *(a+3)=5; return *(a+1+2); }'
+
 assert 0 'int main() { return 0==1; }'
 assert 1 'int main() { return 42==42; }'
 assert 1 'int main() { return 0!=1; }'
@@ -102,6 +144,14 @@ assert 5 'int main() { return ret5(); }'
 assert 8 'int main() { return add(3, 5); }'
 assert 2 'int main() { return sub(5, 3); }'
 assert 21 'int main() { return add6(1,2,3,4,5,6); }'
+assert 64 'int main() { return sub8(100,1,2,3,4,5,6,15); }'
+assert 62 'int main() { return sub8(100,1,2,3,4,5,sub8(9,1,1,1,1,1,1,1),add6(1,2,3,4,5,6)); }'
+assert 25 'int main() { int x; int y; x=ret3(); y=ret3(); return (((((((((x==y)+y)+y)+y)+y)+y)+y)+y)+y); }'
+assert 24 'int main() { int x; int y; x=ret3(); y=ret3(); return (((((((((x!=y)+y)+y)+y)+y)+y)+y)+y)+y); }'
+assert 25 'int main() { int x; int y; x=ret3(); y=ret3(); return (((((((((x<y+1)+y)+y)+y)+y)+y)+y)+y)+y); }'
+assert 25 'int main() { int x; int y; x=ret3(); y=ret3(); return (((((((((x<=y)+y)+y)+y)+y)+y)+y)+y)+y); }'
+assert 7 'int main() { int x; int y; x=ret3(); y=ret3(); if ((((((((((x==y)+y)+y)+y)+y)+y)+y)+y)+y)==25) return 7; return 9; }'
+assert 0 'int f(int a) { if (((0)>(a>=(((0)>=(((((((0)/((0)<=(a))))/a))!=(0))-(1)))<(0)))) != (0)) return 17; return 0; } int main() { return f(ret3()-2); }'
 assert 66 'int main() { return add6(1,2,add6(3,4,5,6,7,8),9,10,11); }'
 assert 136 'int main() { return add6(1,2,add6(3,add6(4,5,6,7,8,9),10,11,12,13),14,15,16); }'
 
@@ -204,10 +254,131 @@ assert 119 'int main() { return "\x77"[0]; }'
 assert 165 'int main() { return "\xA5"[0]; }'
 assert 255 'int main() { return "\x00ff"[0]; }'
 
+assert 1 'int main() { int x=1; { int x=2; } return x; }'
+assert 2 'int main() { int x=1; { x=2; } return x; }'
+assert 3 'int main() { int x=1; { int x=2; { int x=3; return x; } } }'
+assert 5 'int x; int main() { x=5; { int x=2; } return x; }'
+
 assert 0 'int main() { return ({ 0; }); }'
 assert 2 'int main() { return ({ 0; 1; 2; }); }'
 assert 1 'int main() { ({ 0; return 1; 2; }); return 3; }'
 assert 6 'int main() { return ({ 1; }) + ({ 2; }) + ({ 3; }); }'
 assert 3 'int main() { return ({ int x=3; x; }); }'
 
+assert 8 'int main() { int x=3; int y=x*4; if (y==12) return 8; return 9; }'
+assert 9 'int main() { int i=0; int s=0; while (i<0) { s=s+1; i=i+1; } return s+9; }'
+assert 45 'int main() { int i; int s=0; for (i=0; i<10; i=i+1) s=s+i; return s; }'
+assert 44 'int main() { char c; c=300; return c; }'
+assert 44 'int main() { char c; return (c=300)-256; }'
+assert 3 'int main() { int x=1; x=2; x=3; return x; }'
+assert 5 'int main() { int x=ret5(); x=1; return ret5(); }'
+assert 7 'int main() { int x; x=({ ret3(); 7; }); return x; }'
+assert 4 'int main() { int x=2; for (;x==2;) x=4; return x; }'
+assert 1 'int main() { int x=0; if (x) { int y=1/x; return y; } return 1; }'
+assert 21 'int main() { int a=1; int b=2; int i; for (i=0; i<5; i=i+1) { int t=a; a=b; b=t; } return a*10+b; }'
+assert 24 'int main() { int a=1; int b=2; int c=3; int d=4; int e=5; int f=6; int g=7; int h=8; int k=9; int l=10; int i; for (i=0; i<3; i=i+1) { int t=a; a=b; b=c; c=d; d=e; e=f; f=g; g=h; h=k; k=l; l=t; } return a+b*2+c*3+d*4+e*5+f*6+g*7+h*8+k*9+l*10; }'
+assert 5 'int g; int main() { int x=g; g=5; return x+g; }'
+assert 8 'int g; int set(int v) { g=v; return 0; } int main() { int x=g; set(3); return x+g+set(5)+g; }'
+assert 34 'int main() { int x; int y=add(x=ret3(), 1); return x*10+y; }'
+
+assert 21 'int x; int main() { x=7; return x*3; }'
+assert 40 'int x; int main() { x=5; return 8*x; }'
+assert 90 'int x; int main() { x=9; return x*10; }'
+assert 63 'int x; int main() { x=9; return x*7; }'
+assert 3 'int x; int main() { x=-1; return x*-3; }'
+assert 3 'int x; int main() { x=1000000000; return x*(1000000000*6)/(2000000000*1000000000); }'
+assert 14 'int x; int main() { x=100; return x/7; }'
+assert 20 'int x; int main() { x=-100; return x/7+34; }'
+assert 12 'int x; int main() { x=100; return x/8; }'
+assert 37 'int x; int main() { x=-100; return x/8+49; }'
+assert 14 'int x; int main() { x=-100; return x/-7; }'
+assert 12 'int x; int main() { x=-100; return x/-8; }'
+assert 10 'int x; int main() { x=-100; return x/-1-90; }'
+assert 50 'int x; int main() { x=101; return x/2; }'
+assert 3 'int x; int main() { x=-7; return x/2+6; }'
+assert 33 'int x; int main() { x=-100; return x/3+66; }'
+assert 3 'int x; int main() { x=1000000; return x*x/(300000*1000000); }'
+assert 2 'int x[3][3]; int main() { return (x+2)-x; }'
+assert 5 'int main() { int x[3][7]; int *p=x; int *q=&x[1][5]; return q-p-7; }'
+
+assert 12 'int plus(int x, int y) { return x+y; } int sq(int x) { int y; y=x*x; return y; } int main() { return plus(sq(3), plus(1, 2)); }'
+assert 44 'int c(char c) { return c; } int main() { return c(300); }'
+assert 1 'int *p(int *x) { return x; } int main() { int a[2]; return p(a)+1-p(a); }'
+assert 6 'int f(int x) { x=x+1; return x; } int main() { int x=5; f(x); return f(x); }'
+assert 3 'int g(int x) { return x+1; } int h(int x) { return g(g(g(x))); } int main() { return h(0); }'
+assert 1 'int even(int n) { int r=1; if (n) r=odd(n-1); return r; } int odd(int n) { int r=0; if (n) r=even(n-1); return r; } int main() { return even(10); }'
+assert 8 'int i; int bump() { i=i+1; return i; } int main() { int s=0; for (i=0; i<4; bump()) s=s+2; return s; }'
+
+assert 7 'int sum(int n, int acc) { if (n==0) return acc; return sum(n-1, acc+n); } int main() { return sum(10000000, 0) - 5000000*10000001 + 7; }'
+assert 5 'int get(int *p, int n) { if (n) return get(p, n-1); return *p; } int main() { int x=5; return get(&x, 3); }'
+assert 3 'int get(int *p, int n) { if (n) return get(p, n-1); return *p; } int main() { int x[2]; x[1]=3; return get(x+1, 3); }'
+
+assert 198 'int f(int n, int m) { int s=0; int i; int j; for (i=0; i<n; i=i+1) for (j=0; j<n*m; j=j+1) s=s+(n*m)+(n+m); return s; } int main() { return f(3, 2); }'
+assert 12 'int g; int f(int *p) { int s=0; int i=0; g=1; while (i<3) { s=s+g*2; *p=*p+1; i=i+1; } return s; } int main() { return f(&g); }'
+assert 12 'int g; int bump() { g=g+1; return 0; } int f() { int s=0; int i; g=1; for (i=0; i<3; i=i+1) { s=s+g*2; bump(); } return s; } int main() { return f(); }'
+assert 12 'int main() { int x[3]; int i; int k=1; for (i=0; i<3; i=i+1) x[k+1-1]=i*3; return x[1]+x[k]; }'
+assert 36 'int g; int main() { int s=0; int i; g=3; for (i=0; i<4; i=i+1) s=s+g*g; return s; }'
+assert 7 'int f(int n, int d) { int s=7; int i; for (i=0; i<n; i=i+1) s=s+100/d-d*2; return s; } int main() { return f(0, 0); }'
+
+assert 0 'int main() { return "abc" == "abd"; }'
+assert 0 'int main() { return "ab" == "abc"; }'
+assert 98 'int main() { char *p="a\0b"; char *q="a\0c"; return p[2]+(p==q); }'
+
+# Identical string literals are emitted once.
+echo 'int main() { char *p="abc"; char *q="abc"; return p[0]+q[1]; }' |
+  ./ycc -o tmp.s - || exit
+[ "$(grep -c '^\.L\.\.[0-9]*:' tmp.s)" = 1 ] || { echo "literals not pooled"; exit 1; }
+
+assert 10 'char a; int b[100000]; char c; int d; int main() { a=1; b[99999]=3; c=4; d=2; return a+b[99999]+c+d+b[7]; }'
+assert 34 'int main() { return "a\"b"[1]; }'
+assert 92 'int main() { return "a\\b"[1]; }'
+assert 127 'int main() { return "a\177b"[1]; }'
+
+assert 55 'int f7(int a, int b, int c, int d, int e, int f, int g) { if (a) return f7(a-1,b,c,d,e,f,g); return b+c+d+e+f+g; } int main() { return f7(3,5,6,7,8,9,20); }'
+assert 72 'int f9(char a, int b, int c, int d, int e, int f, char g, int h, int i) { if (a) return f9(a-1,b,c,d,e,f,g,h,i); return g*10+h*3-i; } int main() { int x=7; return f9(2,0,0,0,0,0,x*2,f9(0,0,0,0,0,0,1,20,x),1); }'
+assert 64 'int f8(int a, int b, int c, int d, int e, int f, int g, int h) { if (a) return f8(a-1,b,c,d,e,f,g,h); return sub8(100,b,c,d,e,f,g,h); } int main() { return f8(4,1,2,3,4,5,6,15); }'
+
+assert 104 'int lf(int a, int b) { int c; int d[10]; if (a==0) return 0; c = d[0] = d[1] = d[2] = d[3] = d[4] = d[5] = d[6] = d[7] = d[8] = d[9] = a*b + 100/(a+b); return c+d[0]+d[9]+d[4]; } int main() { return lf(3,4) + lf(0,5); }'
+assert 27 'int lf(int a, int b, int c, int d, int e, int f, int g, char h) { if (a) return g*2+h; return 0; } int main() { return lf(1,0,0,0,0,0,11,5) + lf(0,1,1,1,1,1,1,1); }'
+assert 57 'int f(int a) { int x[3]; x[0]=0; x[1]=0; x[2]=5; return (((((((((((a+x[2])+x[2])+x[2])+x[2])+x[2])+x[2])+x[2])+x[2])+x[2])+x[2])+x[2])+a; } int main() { return f(1); }'
+
+assert 18 'int main() { char c; int x; char d; x=0; c=1; d=2; { int a[10]; a[9]=5; x=x+a[9]; } { int b[10]; char e; b[0]=7; e=3; x=x+b[0]+e; } return x+c+d; }'
+assert 21 'int main() { int x=1; { int y=2; { int z=4; x=x+y+z; } { int w=8; x=x+y+w; } } { char v=4; x=x+v; } return x; }'
+assert 31 'int main() { int x=({ int a=10; a+1; }) + ({ int b=20; b; }); { int y=x; { char c=0; x=y+c; } } return x; }'
+
+# A second compilation takes every function from the cache.
+rm -rf tmp.cache
+prog='int sq(int x) { int y=x*x; if (y>100) return 0; return y; } int main() { return sq(3)+sq(4); }'
+flags=$YCCFLAGS
+YCCFLAGS="$flags --cache=tmp.cache"
+assert 25 "$prog"
+assert 25 "$prog"
+YCCFLAGS=$flags
+echo "$prog" | ./ycc $YCCFLAGS --cache=tmp.cache --stats=tmp.json -o $out - || exit
+grep -q '"cache_hits": 2, "cache_misses": 0' tmp.json || { echo "cache missed"; exit 1; }
+rm -rf tmp.cache tmp.json
+
+# With --connect, a running server does the compilations.
+rm -f tmp.sock
+./ycc --server=tmp.sock &
+server=$!
+trap 'kill $server' EXIT
+while [ ! -S tmp.sock ]; do
+  kill -0 $server || exit 1
+  sleep 0.1
+done
+flags=$YCCFLAGS
+YCCFLAGS="--connect=tmp.sock $flags"
+assert 42 'int main() { return 42; }'
+assert 8 'int main() { return ret3()+ret5(); }'
+echo 'int main() { return x; }' | ./ycc $YCCFLAGS -o $out - 2>/dev/null && { echo "error not reported"; exit 1; }
+assert 7 'int main() { return 7; }'
+kill $server
+trap - EXIT
+wait $server 2>/dev/null
+# Without the server, the client fails rather than compiling by itself.
+echo 'int main() { return 7; }' | ./ycc $YCCFLAGS -o $out - 2>/dev/null && { echo "compiled without the server"; exit 1; }
+YCCFLAGS=$flags
+rm -f tmp.sock
+
 echo OK!
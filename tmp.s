@@ -0,0 +1,10 @@
+    .globl main
+    .text
+main:
+    push %rbp
+    mov %rsp,%rbp
+    mov $7,%rax
+.L.return.main:
+    mov %rbp,%rsp
+    pop %rbp
+    ret
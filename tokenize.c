@@ -1,7 +1,14 @@
 #include "ycc.h"
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+static char *current_filename;
 static char *current_input;
 
 void error(char *fmt, ...) {
@@ -11,10 +18,29 @@ void error(char *fmt, ...) {
   fprintf(stderr, "\n");
   exit(1);
 }
+// Reports an error at loc in the form of
+//
+// foo.c:10: x = y + 1;
+//               ^ <error message here>
 static void verror_at(char *loc, char *fmt, va_list ap) {
-  int pos = loc - current_input;
-  fprintf(stderr, "%s\n", current_input);
-  fprintf(stderr, "%*s^ ", pos, "");
+  char *line = loc;
+  while (current_input < line && line[-1] != '\n') {
+    line--;
+  }
+  char *end = loc;
+  while (*end && *end != '\n') {
+    end++;
+  }
+  int line_no = 1;
+  for (char *p = current_input; p < line; p++) {
+    if (*p == '\n') {
+      line_no++;
+    }
+  }
+
+  int indent = fprintf(stderr, "%s:%d: ", current_filename, line_no);
+  fprintf(stderr, "%.*s\n", (int)(end - line), line);
+  fprintf(stderr, "%*s^ ", indent + (int)(loc - line), "");
   vfprintf(stderr, fmt, ap);
   fprintf(stderr, "\n");
   exit(-1);
@@ -28,29 +54,51 @@ void error_at(char *loc, char *fmt, ...) {
 void error_tok(Token *tok, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  error_at(tok->loc, fmt, ap);
+  verror_at(tok->loc, fmt, ap);
 }
 
-static bool startswith(char *p, char *q) {
-  return strncmp(p, q, strlen(q)) == 0;
-}
+// Two-character punctuators, indexed by their first character.
+static struct {
+  char second;
+  int id;
+} punct2[128] = {
+    ['='] = {'=', PT_EQ},
+    ['!'] = {'=', PT_NE},
+    ['<'] = {'=', PT_LE},
+    ['>'] = {'=', PT_GE},
+};
 
-static int read_punct(char *p) {
-  if (startswith(p, "==") || startswith(p, ">=") || startswith(p, "<=") ||
-      startswith(p, "!=")) {
+// Returns the length of the punctuator at p and stores its id, or returns
+// 0 if p doesn't start with a punctuator.
+static int read_punct(char *p, int *id) {
+  unsigned char c = *p;
+  if (c < 128 && punct2[c].id && p[1] == punct2[c].second) {
+    *id = punct2[c].id;
     return 2;
   }
-  return ispunct(*p) ? 1 : 0;
+  if (ispunct(c)) {
+    *id = c;
+    return 1;
+  }
+  return 0;
 }
 
-bool equal(Token *tok, char *op) {
-  return memcmp(tok->loc, op, tok->len) == 0 && op[tok->len] == '\0';
-}
+static char *token_names[] = {
+    [PT_EQ - PT_EQ] = "==",         [PT_NE - PT_EQ] = "!=",
+    [PT_LE - PT_EQ] = "<=",         [PT_GE - PT_EQ] = ">=",
+    [KW_RETURN - PT_EQ] = "return", [KW_IF - PT_EQ] = "if",
+    [KW_ELSE - PT_EQ] = "else",     [KW_FOR - PT_EQ] = "for",
+    [KW_WHILE - PT_EQ] = "while",   [KW_INT - PT_EQ] = "int",
+    [KW_SIZEOF - PT_EQ] = "sizeof", [KW_CHAR - PT_EQ] = "char",
+};
 
-Token *skip(Token *tok, char *s) {
-  if (!equal(tok, s))
-    error_tok(tok, "expected '%s' ", s);
-  return tok->next;
+Token *skip(Token *tok, int id) {
+  if (tok->id != id) {
+    if (id < PT_EQ)
+      error_tok(tok, "expected '%c' ", id);
+    error_tok(tok, "expected '%s' ", token_names[id - PT_EQ]);
+  }
+  return tok_next(tok);
 }
 
 static int get_number(Token *tok) {
@@ -60,7 +108,8 @@ static int get_number(Token *tok) {
 }
 
 static Token *new_token(TokenKind kind, char *start, char *end) {
-  Token *tok = calloc(1, sizeof(Token));
+  Token *tok = arena_alloc(&tok_arena, sizeof(Token));
+  stats.tokens++;
   tok->kind = kind;
   tok->loc = start;
   tok->len = end - start;
@@ -75,33 +124,42 @@ static bool is_indent2(char c) {
   return is_indent1(c) || ('0' <= c && c <= '9');
 }
 
-static bool is_keyword(Token *tok) {
-  static char *kw[] = {"return", "if",  "else",   "for",
-                       "while",  "int", "sizeof", "char"};
-  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++) {
-    if (equal(tok, kw[i]))
-      return true;
+// Returns the keyword id of an identifier, or 0 if it isn't a keyword.
+// (len + p[1]) % 16 is a perfect hash over the keyword set, so a keyword
+// is recognized with one table probe and one comparison.
+static int keyword_id(char *p, int len) {
+  static struct {
+    char *name;
+    int id;
+  } kw[16] = {
+      [(6 + 'e') % 16] = {"return", KW_RETURN},
+      [(2 + 'f') % 16] = {"if", KW_IF},
+      [(4 + 'l') % 16] = {"else", KW_ELSE},
+      [(3 + 'o') % 16] = {"for", KW_FOR},
+      [(5 + 'h') % 16] = {"while", KW_WHILE},
+      [(3 + 'n') % 16] = {"int", KW_INT},
+      [(6 + 'i') % 16] = {"sizeof", KW_SIZEOF},
+      [(4 + 'h') % 16] = {"char", KW_CHAR},
+  };
+  if (len < 2) {
+    return 0;
   }
-  return false;
+  int h = (len + p[1]) % 16;
+  if (kw[h].name && strlen(kw[h].name) == len && !memcmp(p, kw[h].name, len)) {
+    return kw[h].id;
+  }
+  return 0;
 }
 
-bool consume(Token **rest, Token *tok, char *str) {
-  if (equal(tok, str)) {
-    *rest = tok->next;
+bool consume(Token **rest, Token *tok, int id) {
+  if (tok->id == id) {
+    *rest = tok_next(tok);
     return true;
   }
   *rest = tok;
   return false;
 }
 
-static void convert_keywords(Token *tok) {
-  for (Token *t = tok; t->kind != TK_EOF; t = t->next) {
-    if (is_keyword(t)) {
-      t->kind = TK_KEYWORD;
-    }
-  }
-}
-
 static int from_hex(char c) {
   if ('0' <= c && c <= '9') {
     return c - '0';
@@ -173,7 +231,7 @@ static char *string_literal_end(char *p) {
 
 static Token *read_string_literal(char *start) {
   char *end = string_literal_end(start + 1);
-  char *buf = calloc(1, end - start);
+  char *buf = arena_alloc(&tok_arena, end - start);
   int len = 0;
   char *p = start + 1;
   for (char *p = start + 1; p < end;) {
@@ -184,30 +242,230 @@ static Token *read_string_literal(char *start) {
     }
   }
   Token *tok = new_token(TK_STR, start, end + 1);
-  tok->ty = array_of(ty_char, len + 1);
+  tok->val = len + 1;
   tok->str = buf;
   return tok;
 }
 
+// Maps the file read-only. The mapping is backed by anonymous memory
+// past the end of the file, so the contents are always followed by a NUL
+// byte even when the file size is a multiple of the page size.
+static char *map_file(int fd, size_t size) {
+  size_t pagesz = sysconf(_SC_PAGESIZE);
+  size_t len = (size + pagesz) / pagesz * pagesz;
+  char *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+  if (size && mmap(p, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+                  MAP_FAILED) {
+    munmap(p, len);
+    return NULL;
+  }
+  return p;
+}
+
+// Reads a stream that can't be mapped, such as a pipe, into memory.
+static char *read_stream(int fd) {
+  size_t cap = 1 << 16;
+  size_t len = 0;
+  char *buf = malloc(cap);
+  for (;;) {
+    if (len + 1 == cap) {
+      buf = realloc(buf, cap *= 2);
+    }
+    if (!buf) {
+      error("out of memory");
+    }
+    ssize_t n = read(fd, buf + len, cap - len - 1);
+    if (n == 0) {
+      break;
+    }
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      free(buf);
+      return NULL;
+    }
+    len += n;
+  }
+  buf[len] = '\0';
+  return buf;
+}
+
+// Returns the contents of a file, or of stdin if path is "-". The
+// returned buffer is NUL-terminated and is never written to.
+static char *read_file(char *path) {
+  int fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  char *p = NULL;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    p = map_file(fd, st.st_size);
+  }
+  if (!p) {
+    p = read_stream(fd);
+  }
+  int err = errno;
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+  errno = err;
+  return p;
+}
+
+// In pipelined mode the lexer runs on its own thread and links each
+// token into the list as soon as it is complete, while the parser walks
+// the list on the main thread. tok_next() blocks when the parser catches
+// up with the lexer, and the lexer blocks once it is LEX_WINDOW bytes of
+// source ahead of the parser.
+#define LEX_BATCH 256
+#define LEX_WINDOW (1 << 20)
+
+static struct {
+  bool enabled;
+  bool done;
+  int count;
+  pthread_t thread;
+  pthread_mutex_t mu;
+  pthread_cond_t more_tokens;
+  pthread_cond_t more_room;
+  char *parser_pos; // Source position reported by the parser
+  char *report_pos; // Position at which the parser reports next
+  Token head;
+} lexer = {
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+    .more_tokens = PTHREAD_COND_INITIALIZER,
+    .more_room = PTHREAD_COND_INITIALIZER,
+};
+
+// Wakes up a waiting parser and throttles the lexer.
+static void lexer_sync(char *pos) {
+  pthread_mutex_lock(&lexer.mu);
+  pthread_cond_signal(&lexer.more_tokens);
+  while (pos - lexer.parser_pos > LEX_WINDOW) {
+    pthread_cond_wait(&lexer.more_room, &lexer.mu);
+  }
+  pthread_mutex_unlock(&lexer.mu);
+}
+
+static void parser_sync(char *pos) {
+  pthread_mutex_lock(&lexer.mu);
+  lexer.parser_pos = pos;
+  pthread_cond_signal(&lexer.more_room);
+  pthread_mutex_unlock(&lexer.mu);
+  lexer.report_pos = pos + LEX_WINDOW / 4;
+}
+
+static Token *append(Token *cur, Token *tok) {
+  if (!lexer.enabled) {
+    cur->next = tok;
+    return tok;
+  }
+  __atomic_store_n(&cur->next, tok, __ATOMIC_RELEASE);
+  if (++lexer.count % LEX_BATCH == 0) {
+    lexer_sync(tok->loc);
+  }
+  return tok;
+}
+
+Token *tok_next(Token *tok) {
+  if (!lexer.enabled) {
+    return tok->next;
+  }
+  Token *next = __atomic_load_n(&tok->next, __ATOMIC_ACQUIRE);
+  if (next) {
+    if (next->loc >= lexer.report_pos) {
+      parser_sync(next->loc);
+    }
+    return next;
+  }
+
+  pthread_mutex_lock(&lexer.mu);
+  lexer.parser_pos = tok->loc;
+  pthread_cond_signal(&lexer.more_room);
+  while (!(next = __atomic_load_n(&tok->next, __ATOMIC_ACQUIRE)) &&
+         !lexer.done) {
+    pthread_cond_wait(&lexer.more_tokens, &lexer.mu);
+  }
+  pthread_mutex_unlock(&lexer.mu);
+  return next;
+}
+
+static void lex(char *p, Token *head);
+
+static void *lex_main(void *arg) {
+  lex(arg, &lexer.head);
+  pthread_mutex_lock(&lexer.mu);
+  lexer.done = true;
+  pthread_cond_broadcast(&lexer.more_tokens);
+  pthread_mutex_unlock(&lexer.mu);
+  return NULL;
+}
+
+// Starts tokenizing the file on a separate thread and returns its first
+// token. The remaining tokens must be reached through tok_next().
+Token *tokenize_file_async(char *path) {
+  char *p = read_file(path);
+  if (!p) {
+    error("cannot open %s: %s", path, strerror(errno));
+  }
+  current_filename = path;
+  current_input = p;
+  lexer.enabled = true;
+  lexer.parser_pos = p;
+  lexer.report_pos = p + LEX_WINDOW / 4;
+  if (pthread_create(&lexer.thread, NULL, lex_main, p)) {
+    error("cannot create lexer thread");
+  }
+  return tok_next(&lexer.head);
+}
+
+void tokenize_wait(void) {
+  if (lexer.enabled) {
+    pthread_join(lexer.thread, NULL);
+  }
+}
+
+Token *tokenize_file(char *path) {
+  char *p = read_file(path);
+  if (!p) {
+    error("cannot open %s: %s", path, strerror(errno));
+  }
+  current_filename = path;
+  return tokenize(p);
+}
+
 Token *tokenize(char *p) {
+  if (!current_filename) {
+    current_filename = "<input>";
+  }
   current_input = p;
   Token head = {};
-  Token *cur = &head;
+  lex(p, &head);
+  return head.next;
+}
+
+static void lex(char *p, Token *head) {
+  Token *cur = head;
   while (*p) {
     if (isspace(*p)) {
       p++;
       continue;
     }
     if (isdigit(*p)) {
-      cur = cur->next = new_token(TK_NUM, p, p);
-      char *q = p;
-      cur->val = strtoul(p, &p, 10);
-      cur->len = p - q;
+      Token *tok = new_token(TK_NUM, p, p);
+      tok->val = strtoul(p, &p, 10);
+      tok->len = p - tok->loc;
+      cur = append(cur, tok);
       continue;
     }
 
     if (*p == '"') {
-      cur = cur->next = read_string_literal(p);
+      cur = append(cur, read_string_literal(p));
       p += cur->len;
       continue;
     }
@@ -217,19 +475,26 @@ Token *tokenize(char *p) {
       do {
         p++;
       } while (is_indent2(*p));
-      cur = cur->next = new_token(TK_IDENT, start, p);
+      int id = keyword_id(start, p - start);
+      Token *tok = new_token(id ? TK_KEYWORD : TK_IDENT, start, p);
+      tok->id = id;
+      if (!id) {
+        tok->ident = intern(start, p - start);
+      }
+      cur = append(cur, tok);
       continue;
     }
 
-    int punct_len = read_punct(p);
+    int id;
+    int punct_len = read_punct(p, &id);
     if (punct_len) {
-      cur = cur->next = new_token(TK_PUNCT, p, p + punct_len);
-      p += cur->len;
+      Token *tok = new_token(TK_PUNCT, p, p + punct_len);
+      tok->id = id;
+      cur = append(cur, tok);
+      p += punct_len;
       continue;
     }
     error_at(p, "invalid token");
   }
-  cur = cur->next = new_token(TK_EOF, p, p);
-  convert_keywords(head.next);
-  return head.next;
+  append(cur, new_token(TK_EOF, p, p));
 }
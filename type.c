@@ -1,35 +1,42 @@
 #include "ycc.h"
-Type *ty_int = &(Type){TY_INT, .size = 8};
-Type *ty_char = &(Type){TY_CHAR, .size = 1};
+Type *ty_int = &(Type){TY_INT, .size = 8, .align = 8};
+Type *ty_char = &(Type){TY_CHAR, .size = 1, .align = 1};
 
 bool is_integer(Type *type) {
   return type->kind == TY_CHAR || type->kind == TY_INT;
 }
 
 Type *pointer_to(Type *base) {
-  Type *ty = calloc(1, sizeof(Type));
+  Type *ty = arena_alloc(&type_arena, sizeof(Type));
+  stats.types++;
   ty->kind = TY_PTR;
   ty->base = base;
   ty->size = 8;
+  ty->align = 8;
   return ty;
 }
 Type *array_of(Type *base, int len) {
-  Type *ty = calloc(1, sizeof(Type));
+  Type *ty = arena_alloc(&type_arena, sizeof(Type));
+  stats.types++;
   ty->kind = TY_ARRAY;
   ty->size = base->size * len;
+  ty->align = base->align;
   ty->base = base;
   ty->array_len = len;
   return ty;
 }
 
 Type *func_type(Type *return_ty) {
-  Type *ty = calloc(1, sizeof(Type));
+  Type *ty = arena_alloc(&type_arena, sizeof(Type));
+  stats.types++;
   ty->kind = TY_FUNC;
+  ty->align = 1;
   ty->return_ty = return_ty;
   return ty;
 }
 Type *copy_type(Type *ty) {
-  Type *ret = calloc(1, sizeof(Type));
+  Type *ret = arena_alloc(&type_arena, sizeof(Type));
+  stats.types++;
   *ret = *ty;
   return ret;
 }
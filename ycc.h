@@ -1,4 +1,5 @@
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -10,6 +11,11 @@ typedef struct Node Node;
 typedef struct Obj Obj;
 typedef struct Function Function;
 typedef struct Type Type;
+typedef struct Value Value;
+typedef struct Block Block;
+typedef struct Arena Arena;
+typedef struct ArenaChunk ArenaChunk;
+typedef struct HashMap HashMap;
 
 typedef enum {
   TK_PUNCT,
@@ -50,6 +56,7 @@ struct Obj {
   Type *ty;
   int offset; // Offset from RBP
   bool is_local;
+  Obj *scope_next; // Next local declared in the same block
 
   // Global variable or function
   bool is_function;
@@ -59,23 +66,52 @@ struct Obj {
   int stack_size;
   int val;
   char *init_data;
+  bool is_literal; // String literal, placed in a read-only section
+
+  // SSA form of the body, built by optimize()
+  Block **blocks;
+  int nblocks;
+  bool is_promoted; // Local kept in SSA values, without a stack slot
+
+  // Function cache
+  unsigned long hash;
+  char *cached; // Recorded output, if the function was found in the cache
+  int cached_len;
 };
 
+// Sub-kinds of punctuator and keyword tokens, so that the parser can
+// dispatch on integers. A single-character punctuator is identified by
+// its own character code.
+typedef enum {
+  PT_EQ = 256, // ==
+  PT_NE,       // !=
+  PT_LE,       // <=
+  PT_GE,       // >=
+  KW_RETURN,
+  KW_IF,
+  KW_ELSE,
+  KW_FOR,
+  KW_WHILE,
+  KW_INT,
+  KW_SIZEOF,
+  KW_CHAR,
+} TokenId;
+
 struct Token {
   TokenKind kind;
+  int id; // TK_PUNCT and TK_KEYWORD only
   Token *next;
-  int val;
+  int val; // TK_NUM: value, TK_STR: length including the terminating NUL
   char *loc;
   int len;
-  Type *ty;
   char *str;
+  char *ident; // TK_IDENT: interned name
 };
 void error(char *fmt, ...);
 void error_at(char *loc, char *fmt, ...);
 void error_tok(Token *tok, char *fmt, ...);
-bool equal(Token *tok, char *op);
-bool consume(Token **rest, Token *tok, char *str);
-Token *skip(Token *tok, char *op);
+bool consume(Token **rest, Token *tok, int id);
+Token *skip(Token *tok, int id);
 
 // AST Node
 struct Node {
@@ -83,7 +119,8 @@ struct Node {
   Node *next;
   Node *lhs;
   Node *rhs;
-  int val;
+  long val;
+  bool is_exact; // ND_DIV: the dividend is a multiple of the divisor
   Obj *var;
   Type *ty;
 
@@ -99,6 +136,7 @@ struct Node {
   Token *tok;
   // block
   Node *body;
+  Obj *locals; // ND_BLOCK, ND_STMT_EXPR: locals declared in the block
 
   char *funcname;
   Node *args;
@@ -120,6 +158,7 @@ struct Type {
   Type *next;
 
   int size;
+  int align;
   int array_len;
 };
 
@@ -133,22 +172,320 @@ Type *copy_type(Type *type);
 Type *array_of(Type *base, int size);
 void add_type(Node *node);
 
+//
+// arena.c
+//
+
+// Bump allocator with a single bulk release. Each compiler phase
+// allocates its objects from its own arena.
+struct Arena {
+  ArenaChunk *chunks;
+  char *cur;
+  char *end;
+  size_t used; // Bytes handed out
+};
+
+extern Arena tok_arena;  // Token, string literal contents, identifier names
+extern Arena node_arena; // Node
+extern Arena type_arena; // Type
+extern Arena sym_arena;  // Obj and symbol names
+extern Arena ir_arena;   // SSA form, see ir.c
+
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, char *p, size_t len);
+void arena_release(Arena *arena);
+void release_arenas(void);
+size_t arena_total(void);
+
 //
 // tokenize.c
 //
 Token *tokenize(char *input);
+Token *tokenize_file(char *path);
+Token *tokenize_file_async(char *path);
+void tokenize_wait(void);
+Token *tok_next(Token *tok);
 
 //
 // parser.c
 //
 Obj *parse(Token *tok);
 
+//
+// emit.c
+//
+
+// Registers, numbered as in the x86-64 instruction encoding.
+typedef enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8,  R9,  R10, R11, R12, R13, R14, R15,
+} Reg;
+
+typedef enum {
+  I_LABEL, // Label definition
+  I_MOV,
+  I_MOVSBQ,
+  I_MOVZB,
+  I_LEA,
+  I_PUSH,
+  I_POP,
+  I_XCHG,
+  I_ADD,
+  I_SUB,
+  I_IMUL, // imul src,dst, or imul dst into %rdx:%rax
+  I_IDIV,
+  I_SHL,
+  I_SHR,
+  I_SAR,
+  I_CQO,
+  I_NEG,
+  I_CMP,
+  I_SETE,
+  I_SETNE,
+  I_SETL,
+  I_SETLE,
+  I_JMP,
+  I_JE,
+  I_JNE,
+  I_JGE,
+  I_JG,
+  I_CALL,
+  I_RET,
+} Mnemonic;
+
+typedef enum {
+  OP_NONE,
+  OP_REG,    // Register
+  OP_IMM,    // Immediate
+  OP_MEM,    // Memory at base + index * scale + displacement
+  OP_SYM,    // Memory at symbol, RIP-relative
+  OP_LABEL,  // Function-local label
+  OP_GLOBAL, // Global symbol as a call target or label
+} OperandKind;
+
+typedef struct {
+  OperandKind kind;
+  int size;   // OP_REG: 1 or 8 bytes
+  Reg reg;    // OP_REG, OP_MEM
+  long val;   // OP_IMM: value, OP_MEM: displacement, OP_LABEL: number or -1
+  char *name; // OP_SYM, OP_GLOBAL: symbol, OP_LABEL: label prefix
+  Reg index;  // OP_MEM: index register if scale is nonzero
+  int scale;  // OP_MEM: 1, 2, 4 or 8, or 0 if there is no index
+} Operand;
+
+typedef struct {
+  Mnemonic op;
+  Operand src;
+  Operand dst;
+} Insn;
+
+typedef struct Output Output;
+
+void emit_open(int fd, bool object);
+Output *output_new(char *scope);
+void emit_to(Output *o);
+void emit_output(Output *o);
+void emit_flush(void);
+// One-operand instructions take their operand in dst.
+void emit_insn(Mnemonic op, Operand src, Operand dst);
+void emit_directive(char *dir, char *arg);
+void emit_directive_num(char *dir, long val);
+long emit_insn_count(void);
+void output_record(Output *o);
+char *output_recording(Output *o, int *len);
+void emit_replay(char *buf, int len);
+
+//
+// peephole.c
+//
+int peephole(Insn *insns, int n);
+void peephole_report(FILE *out);
+
+//
+// elf.c
+//
+
+typedef struct Object Object;
+
+Object *obj_new(void);
+void obj_insn(Object *obj, Mnemonic op, Operand *src, Operand *dst);
+void obj_directive(Object *obj, char *dir, char *arg, long val);
+void obj_append(Object *dst, Object *src);
+char *obj_finish(Object *obj, int *len);
+
+//
+// fold.c
+//
+void fold(Obj *prog);
+
+//
+// inline.c
+//
+void inline_functions(Obj *prog);
+
+//
+// licm.c
+//
+void licm(Obj *fn);
+
+//
+// ir.c
+//
+
+typedef enum {
+  V_CONST,  // val
+  V_PARAM,  // Parameter var as passed, in its stack slot
+  V_ADDR,   // Address of var
+  V_LOAD,   // Load of ty from args[0]
+  V_STORE,  // Store of args[1] as ty to args[0]
+  V_CALL,   // Call of funcname with args
+  V_NEG,
+  V_BINARY, // op applied to args[0] and args[1]
+  V_SEXT8,  // args[0] converted to char, the value stored to a char
+  V_PHI,    // args[i] coming from bb->preds[i]
+  V_BRANCH, // Terminator: to succs[0] if args[0] is nonzero, else succs[1]
+  V_RET,    // Terminator: returns args[0]
+} ValueKind;
+
+typedef enum { TOP, CONST, BOTTOM } Lattice;
+
+struct Value {
+  ValueKind kind;
+  NodeKind op;
+  long val;
+  bool is_exact; // V_BINARY: as in Node
+  Obj *var;      // V_PARAM, V_ADDR, or V_PHI: variable merged by the phi
+  Type *ty;
+  char *funcname;
+  Block *bb;
+  int pos; // Index in bb->values
+  Value **args;
+  int nargs;
+  int args_cap;
+  Value **users;
+  int nusers;
+  int users_cap;
+  Value *same; // V_PHI: the value a trivial phi is replaced by
+
+  Lattice lat;
+  long cval; // Value if lat is CONST
+  bool live;
+  int nuses;    // Uses by live values
+  bool inlined; // Computed where it is used rather than where it is defined
+  Obj *home;    // Stack slot of a value used in other places
+};
+
+typedef struct {
+  Block *from;
+  bool exec; // Known to be executable by SCCP
+} Edge;
+
+struct Block {
+  int id; // Position in the function's list of blocks
+  Edge *preds;
+  int npreds;
+  int preds_cap;
+  Block *succs[2]; // If there is a branch, succs[0] is taken on nonzero
+  int nsuccs;
+  Value *term; // V_BRANCH or V_RET, or NULL for a jump or the end
+  Value **values;
+  int nvalues;
+  int values_cap;
+  Value **incomplete; // Phis to be completed once all preds are known
+  int nincomplete;
+  int incomplete_cap;
+  bool sealed;
+  bool reachable;
+};
+
+bool find_escape(Node *node);
+bool is_exec(Block *from, Block *to);
+bool is_remat(Value *v);
+void optimize(Obj *prog);
+
+//
+// cache.c
+//
+void cache_open(char *dir, long limit);
+void cache_lookup(Obj *prog);
+void cache_store(Obj *fn, char *buf, int len);
+void cache_close(Obj *prog);
+
 //
 // codegen.c
 //
 void codegen(Obj *node);
 
+//
+// main.c
+//
+extern int opt_fthreads;
+extern bool opt_fpeephole;
+extern bool opt_flicm;
+extern bool opt_foptimize_sibling_calls;
+extern bool opt_fomit_frame_pointer;
+extern char *opt_cache;
+int compile(int argc, char **argv);
+
+//
+// server.c
+//
+void server_run(char *path);
+int client_run(char *path, int argc, char **argv);
+
+//
+// stats.c
+//
+
+typedef enum {
+  PHASE_TOKENIZE,
+  PHASE_PARSE,
+  PHASE_FOLD,
+  PHASE_INLINE,
+  PHASE_OPTIMIZE,
+  PHASE_CODEGEN,
+  NPHASES,
+} Phase;
+
+// Counters for -ftime-report. Each one is only updated by one thread at
+// a time.
+typedef struct {
+  long tokens;
+  long nodes;
+  long types;
+  long objs;
+  long cache_hits;
+  long cache_misses;
+} Stats;
+
+extern Stats stats;
+
+void phase_start(Phase phase);
+void stats_report(FILE *out);
+void stats_report_json(FILE *out);
+
 //
 // strings.c
 //
 char *format(char *fmt, ...);
+char *intern(char *p, int len);
+
+//
+// hashmap.c
+//
+
+typedef struct {
+  char *key;
+  int keylen;
+  void *val;
+} HashEntry;
+
+struct HashMap {
+  HashEntry *buckets;
+  int capacity;
+  int used;
+};
+
+void *hashmap_get(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, int keylen, void *val);
+void hashmap_free(HashMap *map);